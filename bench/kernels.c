@@ -0,0 +1,431 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+/* Microbenchmarks of GFlow's per-cell kernels: parsing the habitat,
+ * discarding islands, building the conductance matrix, the current and
+ * accumulation passes, expanding matrix rows, writing maps and
+ * generating pairs.  No solves and no communication, so a change to one
+ * kernel can be measured on its own.  Each kernel runs -repeat times on
+ * a generated landscape of every size in -sizes and the best time is
+ * kept.  A wide landscape, rows longer than the blocks the per-cell
+ * passes work in, then repeats the kernels that read the conductance
+ * grid, reported with "_wide" after the kernel and its columns as side.
+ *
+ *   -sizes 256,1024,4096   grid sides
+ *   -wide 131072,64        columns and rows of the wide landscape, 0 skips it
+ *   -repeat 3
+ *   -nodata 0.2            fraction of cells without habitat
+ *   -nodes 1000            focal nodes for the pair kernels
+ *   -pair_radius 0         distance limit in pixels, 0 for side/8
+ *   -seed 1
+ *   -threads n
+ *   -work_dir dir          scratch files (/tmp)
+ *   -output file           CSV (bench/kernels.csv)
+ *
+ * Columns: kernel, side, items (cells or pairs), seconds, ns per item
+ * and GB/s.  The bytes behind GB/s are the arrays each kernel must read
+ * and write, counted once, so the figure is a lower bound on the
+ * traffic and comparable from one version to the next.
+ *
+ * The kernels are called through the entry points output.h and
+ * nodelist.h give them, and the bench links against the same objects
+ * as gflow.x. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <petsc.h>
+
+#include "habitat.h"
+#include "conductance.h"
+#include "nodelist.h"
+#include "output.h"
+#include "perf.h"
+#include "threads.h"
+#include "tiles.h"
+#include "util.h"
+
+#define MAX_SIZES 16
+
+/* Cells are NODATA in square clumps of this side */
+#define NODATA_CLUMP 16
+
+static PetscInt sizes[MAX_SIZES] = { 256, 1024, 4096 };
+static PetscInt nsizes = 3;
+static PetscInt wide[2] = { 131072, 64 };
+static PetscInt repeat = 3;
+static PetscReal nodata = 0.2;
+static PetscInt nnodes = 1000;
+static PetscReal pair_radius = 0;
+static PetscInt seed = 1;
+static char work_dir[PATH_MAX] = "/tmp";
+static char csv_filename[PATH_MAX] = "bench/kernels.csv";
+
+static FILE *csv;
+static const char *kernel_suffix = "";
+
+/* Rows expanded at a time, as the manager sends them */
+#define EXPAND_ROWS (1 << 16)
+
+struct Timer
+{
+   double best, start;
+};
+
+static void timer_start(struct Timer *t)
+{
+   t->start = microtime();
+}
+
+static void timer_stop(struct Timer *t)
+{
+   double elapsed = microtime() - t->start;
+   if(t->best < 0 || elapsed < t->best)
+      t->best = elapsed;
+}
+
+static void report(const char *kernel, int side, size_t items, double bytes, struct Timer *t)
+{
+   double ns = items > 0 ? t->best * 1e9 / items : 0.;
+   double gbs = t->best > 0 ? bytes / t->best / 1e9 : 0.;
+
+   char   name[64];
+
+   snprintf(name, sizeof(name), "%s%s", kernel, kernel_suffix);
+   fprintf(csv, "%s,%d,%zu,%.6f,%.3f,%.3f\n", name, side, items, t->best, ns, gbs);
+   fflush(csv);
+   message("%-17s %6d %12zu %10.6f s %9.3f ns/item %8.3f GB/s\n",
+           name, side, items, t->best, ns, gbs);
+}
+
+/* A resistance surface of nrows x ncols cells, 1 to 100, with NODATA in
+ * clumps so that there are islands to discard */
+static void write_landscape(const char *filename, int nrows, int ncols, struct Rng *rng)
+{
+   FILE  *f = fopen(filename, "w");
+   char  *hole;
+   int    nclumps = (ncols + NODATA_CLUMP - 1) / NODATA_CLUMP;
+   int    i, j;
+
+   hole = (char *)malloc((size_t)nclumps * ((nrows + NODATA_CLUMP - 1) / NODATA_CLUMP));
+   for(i = 0; i < nclumps * ((nrows + NODATA_CLUMP - 1) / NODATA_CLUMP); i++)
+      hole[i] = rng_double(rng) < nodata;
+   fprintf(f, "ncols %d\nnrows %d\nxllcorner 0\nyllcorner 0\ncellsize 1\nNODATA_value -9999\n",
+           ncols, nrows);
+   for(i = 0; i < nrows; i++) {
+      for(j = 0; j < ncols; j++) {
+         if(hole[(i / NODATA_CLUMP) * nclumps + j / NODATA_CLUMP])
+            fputs("-9999 ", f);
+         else
+            fprintf(f, "%.3f ", 1. + 99. * rng_double(rng));
+      }
+      fputc('\n', f);
+   }
+   fclose(f);
+   free(hole);
+}
+
+static void bench_parse(const char *filename, int side, struct ResistanceGrid *R)
+{
+   struct Timer t = { -1 };
+   size_t ncells = (size_t)side * side;
+   int r;
+
+   for(r = 0; r < repeat; r++) {
+      timer_start(&t);
+      parse_habitat_file(R, filename);
+      timer_stop(&t);
+      free_habitat(R);
+   }
+   report("parse", side, ncells,
+          file_size(filename) + ncells * (sizeof(float) + sizeof(PetscInt)), &t);
+}
+
+/* Leaves R parsed, without its islands */
+static void bench_islands(const char *filename, int side, struct ResistanceGrid *R)
+{
+   struct Timer t = { -1 };
+   size_t ncells = (size_t)side * side;
+   int r;
+
+   for(r = 0; r < repeat; r++) {
+      if(r > 0)
+         free_habitat(R);
+      parse_habitat_file(R, filename);
+      timer_start(&t);
+      discard_islands(R);
+      timer_stop(&t);
+   }
+   /* the labelling reads and rewrites every index */
+   report("islands", side, ncells, ncells * (sizeof(float) + 2 * sizeof(PetscInt)), &t);
+}
+
+/* Leaves G built */
+static void bench_conductance(int side, struct ResistanceGrid *R, struct ConductanceGrid *G)
+{
+   struct Timer t = { -1 };
+   size_t ncells = (size_t)R->nrows * R->ncols;
+   int r;
+
+   for(r = 0; r < repeat; r++) {
+      if(r > 0)
+         free_conductance(G);
+      timer_start(&t);
+      init_conductance(R, G);
+      timer_stop(&t);
+   }
+   report("conductance", side, G->nrows,
+          ncells * (sizeof(float) + sizeof(PetscInt))
+          + G->nrows * G->edges.elsize, &t);
+}
+
+static void bench_current(int side, struct ConductanceGrid *G, struct TileArray *voltages)
+{
+   struct Timer t = { -1 };
+   int r;
+
+   for(r = 0; r < repeat; r++) {
+      timer_start(&t);
+      calculate_current(G, voltages, 0, G->nrows);
+      timer_stop(&t);
+   }
+   report("current", side, G->nrows,
+          G->nrows * (G->edges.elsize + sizeof(double) + sizeof(float)), &t);
+}
+
+/* Every row of the matrix in EXPAND_ROWS pieces, as the manager sends
+ * them: by one stream, and with a fresh G_rows() for every piece */
+static void bench_expand(int side, struct ConductanceGrid *G)
+{
+   struct Timer stream = { -1 }, pieces = { -1 };
+   int    *cols   = (int *)malloc(sizeof(int) * EXPAND_ROWS * 9);
+   double *values = (double *)malloc(sizeof(double) * EXPAND_ROWS * 9);
+   double  bytes = G->nrows * (G->edges.elsize + 9 * (sizeof(int) + sizeof(double)));
+   size_t  k, n;
+   int     r;
+
+   for(r = 0; r < repeat; r++) {
+      struct GRowStream S;
+      timer_start(&stream);
+      G_stream_init(&S, G, 0, 0);
+      for(k = 0; k < G->nrows; k += n) {
+         n = MIN(EXPAND_ROWS, G->nrows - k);
+         G_stream_rows(&S, n, cols, values);
+      }
+      G_stream_free(&S);
+      timer_stop(&stream);
+
+      timer_start(&pieces);
+      for(k = 0; k < G->nrows; k += n) {
+         n = MIN(EXPAND_ROWS, G->nrows - k);
+         G_rows(G, k, n, cols, values);
+      }
+      timer_stop(&pieces);
+   }
+   free(cols);
+   free(values);
+   report("expand", side, G->nrows, bytes, &stream);
+   report("expand_rows", side, G->nrows, bytes, &pieces);
+}
+
+/* The pass of write_result() over the per-cell totals and moments */
+static void bench_accumulate(int side, struct ConductanceGrid *G)
+{
+   struct Timer t = { -1 };
+   int r;
+
+   for(r = 0; r < repeat; r++) {
+      timer_start(&t);
+      accumulate_current(G, 1., NULL, NULL);
+      timer_stop(&t);
+   }
+   /* current is read, total, maximum, mean and m2 read and written */
+   report("accumulate", side, G->nrows, G->nrows * 9 * sizeof(float), &t);
+}
+
+static void bench_write(int side, struct ResistanceGrid *R, struct ConductanceGrid *G)
+{
+   const char *kernels[] = { "write_asc", "write_asc_gz", "write_amp" };
+   const char *suffix[]  = { ".asc", ".asc.gz", ".amp" };
+   struct TileArray *current = pair_current_density();
+   char   filename[PATH_MAX + 64];
+   int    format, r;
+
+   for(format = OUTPUT_FORMAT_ASC; format <= OUTPUT_FORMAT_AMP; format++) {
+      struct Timer t = { -1 };
+      snprintf(filename, sizeof(filename), "%s/kernels-%d%s", work_dir, side, suffix[format]);
+      for(r = 0; r < repeat; r++) {
+         timer_start(&t);
+         if(format == OUTPUT_FORMAT_AMP)
+            write_amp(G, filename, current);
+         else
+            write_asc(R, G, filename, current, format == OUTPUT_FORMAT_ASC_GZ);
+         timer_stop(&t);
+      }
+      report(kernels[format], side, G->nrows, file_size(filename) + G->nrows * sizeof(float), &t);
+      unlink(filename);
+   }
+}
+
+/* Generating the pairs and then visiting every one of them */
+static void bench_pairs(int side, struct ResistanceGrid *R, struct Rng *rng)
+{
+   struct Timer t = { -1 };
+   struct PointPairs *pp = NULL;
+   size_t k, i, count = 0;
+   long   checksum = 0;
+   double radius = pair_radius > 0 ? pair_radius : side / 8.;
+   int r;
+
+   for(r = 0; r < repeat; r++) {
+      if(pp)
+         free_point_pairs(pp);
+      pp = (struct PointPairs *)calloc(1, sizeof(struct PointPairs));
+      pp->points = (struct Point *)malloc(sizeof(struct Point) * MAX(nnodes, 1));
+      pp->ncount = nnodes;
+      for(i = 0; i < pp->ncount; i++) {
+         pp->points[i].index = (int)i;
+         pp->points[i].x = (long)rng_uniform(rng, R->nrows);
+         pp->points[i].y = (long)rng_uniform(rng, R->ncols);
+      }
+      timer_start(&t);
+      generate_pairs(pp, radius);
+      for(k = 0; k < pp->count; k++) {
+         struct Pair p = pair_at(pp, k);
+         checksum += p.p1.index ^ p.p2.index;
+      }
+      timer_stop(&t);
+      count = pp->count;
+   }
+   free_point_pairs(pp);
+   message("Pair checksum %ld\n", checksum);
+   report("pairs", side, count, count * sizeof(struct Pair), &t);
+}
+
+static void bench_size(int side, struct Rng *rng)
+{
+   struct ResistanceGrid  R;
+   struct ConductanceGrid G;
+   struct TileArray       voltages;
+   char   filename[PATH_MAX + 64];
+   size_t k;
+
+   snprintf(filename, sizeof(filename), "%s/kernels-%d-habitat.asc", work_dir, side);
+   write_landscape(filename, side, side, rng);
+
+   memset(&R, 0, sizeof(R));
+   bench_parse(filename, side, &R);
+   bench_islands(filename, side, &R);
+   unlink(filename);
+   bench_conductance(side, &R, &G);
+
+   tile_init(&voltages, sizeof(double), G.nrows, habitat_tile_len(&R));
+   for(k = 0; k < G.nrows; k++)
+      *(double *)tile_at(&voltages, k) = rng_double(rng);
+   init_totals(&R, &G);
+   bench_current(side, &G, &voltages);
+   bench_expand(side, &G);
+   bench_accumulate(side, &G);
+   bench_write(side, &R, &G);
+   bench_pairs(side, &R, rng);
+
+   /* the totals are sized for this grid */
+   free_totals();
+   tile_free(&voltages);
+   free_conductance(&G);
+   free_habitat(&R);
+}
+
+/* The kernels that read the conductance grid on a landscape whose rows
+ * are longer than a block of the per-cell passes */
+static void bench_wide(int ncols, int nrows, struct Rng *rng)
+{
+   struct ResistanceGrid  R;
+   struct ConductanceGrid G;
+   struct TileArray       voltages;
+   char   filename[PATH_MAX + 64];
+   size_t k;
+
+   snprintf(filename, sizeof(filename), "%s/kernels-wide-habitat.asc", work_dir);
+   write_landscape(filename, nrows, ncols, rng);
+   memset(&R, 0, sizeof(R));
+   parse_habitat_file(&R, filename);
+   discard_islands(&R);
+   unlink(filename);
+
+   kernel_suffix = "_wide";
+   bench_conductance(ncols, &R, &G);
+   tile_init(&voltages, sizeof(double), G.nrows, habitat_tile_len(&R));
+   for(k = 0; k < G.nrows; k++)
+      *(double *)tile_at(&voltages, k) = rng_double(rng);
+   init_totals(&R, &G);
+   bench_current(ncols, &G, &voltages);
+   bench_expand(ncols, &G);
+   kernel_suffix = "";
+
+   free_totals();
+   tile_free(&voltages);
+   free_conductance(&G);
+   free_habitat(&R);
+}
+
+int main(int argc, char **argv)
+{
+   struct Rng rng;
+   PetscBool  flg;
+   PetscInt   n = MAX_SIZES;
+   int        s;
+
+   PetscInitialize(&argc, &argv, NULL, NULL);
+   PetscOptionsGetIntArray(PETSC_NULL, NULL, "-sizes", sizes, &n, &flg);
+   if(flg)
+      nsizes = n;
+   n = 2;
+   PetscOptionsGetIntArray(PETSC_NULL, NULL, "-wide", wide, &n, &flg);
+   if(flg && n < 2)
+      wide[0] = 0;
+   PetscOptionsGetInt(PETSC_NULL,    NULL, "-repeat",      &repeat,      &flg);
+   PetscOptionsGetReal(PETSC_NULL,   NULL, "-nodata",      &nodata,      &flg);
+   PetscOptionsGetInt(PETSC_NULL,    NULL, "-nodes",       &nnodes,      &flg);
+   PetscOptionsGetReal(PETSC_NULL,   NULL, "-pair_radius", &pair_radius, &flg);
+   PetscOptionsGetInt(PETSC_NULL,    NULL, "-seed",        &seed,        &flg);
+   PetscOptionsGetInt(PETSC_NULL,    NULL, "-threads",     &num_threads, &flg);
+   PetscOptionsGetString(PETSC_NULL, NULL, "-work_dir",    work_dir,     PATH_MAX, &flg);
+   PetscOptionsGetString(PETSC_NULL, NULL, "-output",      csv_filename, PATH_MAX, &flg);
+   repeat = MAX(repeat, 1);
+   perf_init();
+
+   csv = fopen(csv_filename, "w");
+   if(csv == NULL) {
+      fprintf(stderr, "Cannot write %s.\n", csv_filename);
+      PetscFinalize();
+      return 1;
+   }
+   fprintf(csv, "kernel,side,items,seconds,ns_per_item,gb_per_s\n");
+   rng_seed(&rng, (uint64_t)seed);
+   for(s = 0; s < nsizes; s++)
+      bench_size((int)sizes[s], &rng);
+   if(wide[0] > 0 && wide[1] > 0)
+      bench_wide((int)wide[0], (int)wide[1], &rng);
+   fclose(csv);
+   message("Results written to %s.\n", csv_filename);
+
+   free_threads();
+   PetscFinalize();
+   return 0;
+}
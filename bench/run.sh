@@ -0,0 +1,110 @@
+#!/bin/bash
+
+# Scaling benchmark for GFlow on synthetic landscapes.  Runs gflow.x for
+# every combination of landscape type, grid size and rank count and
+# writes one CSV line per run.  Everything is generated locally, so it
+# runs offline and gives the same inputs from release to release.
+#
+# Settings come from the environment:
+#
+#   MODE     strong: the grid is SIZE x SIZE whatever the rank count
+#            weak:   the grid grows with the ranks, SIZE x SIZE cells per rank
+#   TYPES    landscape types for bench/synth.x (fractal fragmented contrast)
+#   SIZES    grid sides (256 512 1024)
+#   RANKS    MPI rank counts (1 2 4)
+#   NODES    focal nodes per landscape; every pair is solved (8, so 28 pairs)
+#   NODATA   fraction of NODATA cells (the type's default when empty)
+#   SEED     seed for the landscapes (1)
+#   THREADS  -threads for rank 0 (1)
+#   MPIEXEC  launcher ("mpiexec")
+#   EXTRA    further gflow.x options
+#   WORK     scratch directory (bench/work)
+#   OUT      CSV file (bench/results.csv)
+#
+# Columns: setup_s is rank 0's parse, island, conductance and
+# distribution time; pairs_per_s and efficiency use the time after
+# setup; solve_s is the mean time of one solve (KSP setup and solve);
+# efficiency is against the first rank count of the same type and size.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+GFLOW=${GFLOW:-$BENCH_DIR/../gflow.x}
+SYNTH=${SYNTH:-$BENCH_DIR/synth.x}
+MODE=${MODE:-strong}
+TYPES=${TYPES:-"fractal fragmented contrast"}
+SIZES=${SIZES:-"256 512 1024"}
+RANKS=${RANKS:-"1 2 4"}
+NODES=${NODES:-8}
+NODATA=${NODATA:-}
+SEED=${SEED:-1}
+THREADS=${THREADS:-1}
+MPIEXEC=${MPIEXEC:-mpiexec}
+EXTRA=${EXTRA:-}
+WORK=${WORK:-$BENCH_DIR/work}
+OUT=${OUT:-$BENCH_DIR/results.csv}
+
+[[ -x $GFLOW ]] || { echo "$GFLOW not found; run make first" >&2; exit 1; }
+[[ -x $SYNTH ]] || { echo "$SYNTH not found; run make bench/synth.x first" >&2; exit 1; }
+[[ $MODE == strong || $MODE == weak ]] || { echo "MODE must be strong or weak" >&2; exit 1; }
+mkdir -p "$WORK"
+
+# wall, pairs, setup, mean solve time and number of solves from a -perf_report file
+summarize() {
+   awk '
+      { line = $0; gsub(/[{}",:]/, " ", line); n = split(line, f, " ") }
+      /^  "wall_seconds"/ { wall = f[2] }
+      /^  "pairs":/       { for(i = 1; i < n; i++) if(f[i] == "solved") pairs = f[i+1] }
+      /"rank":/ {
+         for(i = 1; i < n; i++) {
+            if(f[i] == "rank") r = f[i+1]
+            if(r == 0 && (f[i] == "parse" || f[i] == "islands" || f[i] == "conductance" || f[i] == "distribute"))
+               setup += f[i+1]
+            if(f[i] == "ksp_setup" || f[i] == "ksp_solve")
+               ksp += f[i+1]
+         }
+      }
+      /"solves":/ { for(i = 1; i < n; i++) if(f[i] == "solves") solves += f[i+1] }
+      END { printf "%s %s %.6f %.6f\n", wall, pairs, setup, (solves > 0 ? ksp / solves : 0) }' "$1"
+}
+
+echo "mode,type,rows,cols,nodata,nodes,ranks,threads,pairs,wall_s,setup_s,solve_s,pairs_per_s,efficiency" > "$OUT"
+for type in $TYPES; do
+   for size in $SIZES; do
+      base=""
+      for ranks in $RANKS; do
+         if [[ $MODE == weak ]]; then
+            side=$(awk -v s="$size" -v p="$ranks" 'BEGIN { printf "%d", s * sqrt(p) + 0.5 }')
+         else
+            side=$size
+         fi
+         name=$type-$side-s$SEED
+         if [[ ! -f $WORK/$name.asc ]]; then
+            "$SYNTH" -type "$type" -rows "$side" -cols "$side" -nodes "$NODES" -seed "$SEED" \
+                     ${NODATA:+-nodata "$NODATA"} \
+                     -habitat "$WORK/$name.asc" -nodes_file "$WORK/$name.txt"
+         fi
+         report=$WORK/$name-n$ranks.json
+         rm -f "$report"
+         $MPIEXEC -n "$ranks" "$GFLOW" -habitat "$WORK/$name.asc" -nodes "$WORK/$name.txt" \
+                  -threads "$THREADS" -perf_report "$report" $EXTRA > "$WORK/$name-n$ranks.log" 2>&1 \
+            || { echo "gflow failed, see $WORK/$name-n$ranks.log" >&2; exit 1; }
+         read wall pairs setup solve < <(summarize "$report")
+         loop=$(awk -v w="$wall" -v s="$setup" 'BEGIN { printf "%.6f", w - s }')
+         [[ -n $base ]] || base="$loop $ranks"
+         awk -v OFS=, -v mode="$MODE" -v type="$type" -v side="$side" -v nodata="$NODATA" \
+             -v nodes="$NODES" -v ranks="$ranks" -v threads="$THREADS" -v pairs="$pairs" \
+             -v wall="$wall" -v setup="$setup" -v solve="$solve" -v loop="$loop" -v base="$base" '
+            BEGIN {
+               split(base, b, " ")
+               rate = loop > 0 ? pairs / loop : 0
+               if(mode == "strong")
+                  eff = loop > 0 ? (b[1] * b[2]) / (loop * ranks) : 0
+               else
+                  eff = loop > 0 ? b[1] / loop : 0
+               print mode, type, side, side, nodata, nodes, ranks, threads, pairs,
+                     wall, setup, solve, sprintf("%.3f", rate), sprintf("%.3f", eff)
+            }' | tee -a "$OUT"
+      done
+   done
+done
@@ -0,0 +1,257 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+/* Synthetic landscapes for benchmarking GFlow.  Writes a resistance
+ * surface (.asc) and a list of focal nodes; the same arguments always
+ * give the same files.
+ *
+ *   fractal     resistance from fractal noise, 1 to 100, with a few
+ *               large NODATA holes
+ *   fragmented  many small habitat patches in a NODATA background
+ *   contrast    a low resistance matrix cut by barriers of resistance
+ *               -contrast
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+struct Options
+{
+   const char *type;
+   int    rows, cols;
+   double nodata;      /* fraction of cells without habitat */
+   int    nodes;
+   double contrast;
+   uint64_t seed;
+   const char *habitat, *nodes_file;
+};
+
+static uint64_t rng_state;
+
+static uint64_t next_random()
+{
+   uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return z ^ (z >> 31);
+}
+
+static double uniform()
+{
+   return (next_random() >> 11) * (1. / 9007199254740992.);
+}
+
+static double smooth(double t)
+{
+   return t * t * (3. - 2. * t);
+}
+
+/* Value noise: random values on a lattice `scale` cells apart, smoothly
+ * interpolated, summed over octaves whose weight halves as the lattice
+ * halves.  The result is scaled to [0,1]. */
+static void fractal_noise(float *field, int rows, int cols, int scale, int octaves)
+{
+   size_t n = (size_t)rows * cols, k;
+   float  lo, hi;
+   double weight = 1.;
+   int    o, i, j;
+
+   memset(field, 0, sizeof(float) * n);
+   for(o = 0; o < octaves && scale >= 1; o++, scale /= 2, weight *= 0.5) {
+      int lr = rows / scale + 2, lc = cols / scale + 2;
+      float *lattice = (float *)malloc(sizeof(float) * lr * lc);
+      for(k = 0; k < (size_t)lr * lc; k++)
+         lattice[k] = (float)uniform();
+      for(i = 0; i < rows; i++) {
+         int    y = i / scale;
+         double ty = smooth((double)(i % scale) / scale);
+         for(j = 0; j < cols; j++) {
+            int    x = j / scale;
+            double tx = smooth((double)(j % scale) / scale);
+            double top = lattice[y*lc + x] * (1. - tx) + lattice[y*lc + x + 1] * tx;
+            double bot = lattice[(y+1)*lc + x] * (1. - tx) + lattice[(y+1)*lc + x + 1] * tx;
+            field[(size_t)i*cols + j] += (float)(weight * (top * (1. - ty) + bot * ty));
+         }
+      }
+      free(lattice);
+   }
+   lo = hi = field[0];
+   for(k = 1; k < n; k++) {
+      lo = fminf(lo, field[k]);
+      hi = fmaxf(hi, field[k]);
+   }
+   for(k = 0; k < n; k++)
+      field[k] = hi > lo ? (field[k] - lo) / (hi - lo) : 0.f;
+}
+
+/* The value below which `fraction` of the field lies, from a histogram */
+#define QUANTILE_BINS 65536
+static float quantile(const float *field, size_t n, double fraction)
+{
+   size_t *hist = (size_t *)calloc(QUANTILE_BINS, sizeof(size_t));
+   size_t  k, seen = 0, target = (size_t)(fraction * n);
+   int     b;
+
+   for(k = 0; k < n; k++)
+      ++hist[(int)(field[k] * (QUANTILE_BINS - 1))];
+   for(b = 0; b < QUANTILE_BINS - 1 && seen + hist[b] <= target; b++)
+      seen += hist[b];
+   free(hist);
+   return (float)b / (QUANTILE_BINS - 1);
+}
+
+static int largest_scale(int rows, int cols, int divisions)
+{
+   int s = 1;
+   while(s * divisions < (rows > cols ? rows : cols))
+      s *= 2;
+   return s;
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr,
+      "usage: %s [-type fractal|fragmented|contrast] [-rows N] [-cols N] [-nodata F]\n"
+      "          [-nodes K] [-contrast C] [-seed S] -habitat FILE.asc -nodes_file FILE\n", prog);
+   exit(1);
+}
+
+static void parse_options(struct Options *o, int argc, char *argv[])
+{
+   int i;
+
+   o->type = "fractal";
+   o->rows = o->cols = 512;
+   o->nodata = -1.;   /* the type's default */
+   o->nodes = 16;
+   o->contrast = 1000.;
+   o->seed = 1;
+   o->habitat = o->nodes_file = NULL;
+   for(i = 1; i + 1 < argc; i += 2) {
+      if(strcmp(argv[i], "-type") == 0)
+         o->type = argv[i+1];
+      else if(strcmp(argv[i], "-rows") == 0)
+         o->rows = atoi(argv[i+1]);
+      else if(strcmp(argv[i], "-cols") == 0)
+         o->cols = atoi(argv[i+1]);
+      else if(strcmp(argv[i], "-nodata") == 0)
+         o->nodata = atof(argv[i+1]);
+      else if(strcmp(argv[i], "-nodes") == 0)
+         o->nodes = atoi(argv[i+1]);
+      else if(strcmp(argv[i], "-contrast") == 0)
+         o->contrast = atof(argv[i+1]);
+      else if(strcmp(argv[i], "-seed") == 0)
+         o->seed = strtoull(argv[i+1], NULL, 0);
+      else if(strcmp(argv[i], "-habitat") == 0)
+         o->habitat = argv[i+1];
+      else if(strcmp(argv[i], "-nodes_file") == 0)
+         o->nodes_file = argv[i+1];
+      else
+         usage(argv[0]);
+   }
+   if(i != argc || !o->habitat || !o->nodes_file || o->rows < 1 || o->cols < 1 || o->nodes < 2)
+      usage(argv[0]);
+   if(strcmp(o->type, "fractal") && strcmp(o->type, "fragmented") && strcmp(o->type, "contrast"))
+      usage(argv[0]);
+   if(o->nodata < 0.)
+      o->nodata = strcmp(o->type, "fragmented") == 0 ? 0.5 : 0.1;
+   if(o->nodata >= 1.)
+      o->nodata = 0.99;
+}
+
+int main(int argc, char *argv[])
+{
+   struct Options o;
+   size_t n, k, habitat = 0;
+   float *resistance, *mask, cut;
+   FILE  *f;
+   int    i;
+
+   parse_options(&o, argc, argv);
+   rng_state = o.seed;
+   n = (size_t)o.rows * o.cols;
+   resistance = (float *)malloc(sizeof(float) * n);
+   mask = (float *)malloc(sizeof(float) * n);
+   if(!resistance || !mask) {
+      fprintf(stderr, "out of memory for a %dx%d grid\n", o.rows, o.cols);
+      return 1;
+   }
+
+   /* where the habitat is: a few broad holes, or many small patches */
+   if(strcmp(o.type, "fragmented") == 0)
+      fractal_noise(mask, o.rows, o.cols, 8, 2);
+   else
+      fractal_noise(mask, o.rows, o.cols, largest_scale(o.rows, o.cols, 4), 3);
+   cut = o.nodata > 0. ? quantile(mask, n, o.nodata) : -1.f;
+
+   fractal_noise(resistance, o.rows, o.cols, largest_scale(o.rows, o.cols, 2), 8);
+   for(k = 0; k < n; k++) {
+      if(mask[k] < cut)
+         resistance[k] = -9999.f;
+      else if(strcmp(o.type, "fractal") == 0)
+         resistance[k] = (float)pow(10., 2. * resistance[k]);
+      else if(strcmp(o.type, "fragmented") == 0)
+         resistance[k] = (float)(1. + 9. * resistance[k]);
+      else
+         resistance[k] = fabsf(resistance[k] - 0.5f) < 0.02f ? (float)o.contrast : 1.f;
+      if(resistance[k] > 0)
+         ++habitat;
+   }
+   free(mask);
+   if(habitat < (size_t)o.nodes) {
+      fprintf(stderr, "only %zu habitat cells for %d nodes\n", habitat, o.nodes);
+      return 1;
+   }
+
+   f = fopen(o.habitat, "w");
+   if(f == NULL) {
+      perror(o.habitat);
+      return 1;
+   }
+   fprintf(f, "ncols %d\nnrows %d\nxllcorner 0\nyllcorner 0\ncellsize 100\nNODATA_value -9999\n", o.cols, o.rows);
+   for(i = 0; i < o.rows; i++) {
+      int j;
+      for(j = 0; j < o.cols; j++)
+         fprintf(f, "%g ", resistance[(size_t)i*o.cols + j]);
+      fputc('\n', f);
+   }
+   fclose(f);
+
+   /* nodes on distinct habitat cells, numbered from 1 as GFlow reads
+    * them; the last line has no newline, since the reader would take a
+    * trailing one for another node */
+   f = fopen(o.nodes_file, "w");
+   if(f == NULL) {
+      perror(o.nodes_file);
+      return 1;
+   }
+   for(i = 0; i < o.nodes; i++) {
+      do {
+         k = (size_t)(uniform() * n);
+      } while(resistance[k] <= 0);
+      fprintf(f, "%s%zu %zu", i > 0 ? "\n" : "", k / o.cols + 1, k % o.cols + 1);
+      resistance[k] = -resistance[k];   /* taken */
+   }
+   fclose(f);
+   free(resistance);
+   fprintf(stderr, "%s: %dx%d %s, %zu habitat cells, %d nodes\n",
+           o.habitat, o.rows, o.cols, o.type, habitat, o.nodes);
+   return 0;
+}
@@ -0,0 +1,259 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <petsc.h>
+
+#include "conductance.h"
+#include "habitat.h"
+#include "threads.h"
+#include "tiles.h"
+#include "util.h"
+
+/* Raster offset of each forward edge */
+static const int edge_a[G_NEDGES] = { 0, 1, 1, 1 };
+static const int edge_b[G_NEDGES] = { 1, -1, 0, 1 };
+
+/* Largest distance in the numbering from a cell to the first of its
+ * neighbours in the row below that `link` can hold */
+#define MAX_LINK (UINT32_MAX >> G_LINK_SHIFT)
+
+/* `values` holds raster rows i-1, i and i+1.  The conductance between
+ * cell (i,j) and its neighbour (i+a,j+b) */
+static double edge_conductance(const float **values, size_t i, size_t j, off_t a, off_t b)
+{
+   double val1 = values[1][j];
+   double val2 = values[1+a][j+b];
+   double value = 2. / (val1 + val2);
+   if((a&b) != 0) /*a != 0 && b != 0)*/
+      value *= M_SQRT1_2;
+   if(isinf(value)) {
+      message("Infinite value found. R[%zu][%zu] = %lf; R[%llu][%llu] = %lf\n", i, j, val1,
+              (unsigned long long)(i+a), (unsigned long long)(j+b), val2);
+   }
+   return value;
+}
+
+struct ConductanceRows
+{
+   struct ResistanceGrid  *R;
+   struct ConductanceGrid *G;
+};
+
+/* Every cell records its own forward edges, so raster rows can be built
+ * by different threads */
+static void conductance_rows(size_t start, size_t end, int tid, void *arg)
+{
+   struct ResistanceGrid  *R = ((struct ConductanceRows *)arg)->R;
+   struct ConductanceGrid *G = ((struct ConductanceRows *)arg)->G;
+   size_t i;
+   int    j, d;
+
+   for(i = start; i < end; i++) {
+      const float    *values[3];
+      const PetscInt *index[3];
+      values[1] = values_row(R, i);
+      index[1]  = index_row(R, i);
+      if(i < R->nrows-1) {
+         values[2] = values_row(R, i+1);
+         index[2]  = index_row(R, i+1);
+      }
+      for(j = 0; j < R->ncols; j++) {
+         struct GEdges *e;
+         PetscInt id1 = index[1][j], first = -1;
+
+         if(id1 == -1)
+            continue;
+         e = G_edges(G, id1);
+         e->link = 0;
+         for(d = 0; d < G_NEDGES; d++) {
+            int a = edge_a[d], b = edge_b[d];
+            PetscInt id2;
+
+            e->value[d] = 0.f;
+            if((a > 0 && i == R->nrows-1) || (b < 0 && j == 0) || (b > 0 && j == R->ncols-1))
+               continue;
+            id2 = index[1+a][j+b];
+            if(id2 == -1)
+               continue;
+            e->value[d] = (float)edge_conductance(values, i, j, a, b);
+            e->link |= 1u << d;
+            if(a > 0 && first == -1)
+               first = id2;
+         }
+         if(first != -1) {
+            if((size_t)(first - id1) > MAX_LINK) {
+               message("Error; raster rows are too long for the conductance grid.\n");
+               MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            e->link |= (uint32_t)(first - id1) << G_LINK_SHIFT;
+         }
+      }
+   }
+}
+
+PetscErrorCode init_conductance(struct ResistanceGrid *R, struct ConductanceGrid *G)
+{
+   struct ConductanceRows cr = { R, G };
+
+   message("Number of unknowns: %zu\n", R->cell_count);
+
+   /* the first neighbour in the row below is at most a raster row on,
+    * the last two after that */
+   G->nrows = R->cell_count;
+   G->reach = (size_t)R->ncols + 2;
+   tile_init(&G->edges, sizeof(struct GEdges), G->nrows, habitat_tile_len(R));
+   parallel_for_if(!tile_is_mapped(&R->values) && !tile_is_mapped(&G->edges),
+                   R->nrows, conductance_rows, &cr);
+
+   return 0;
+}
+
+void free_conductance(struct ConductanceGrid *G)
+{
+   tile_free(&G->edges);
+}
+
+/* Edge of conductance `c` in slot `slot` of a row holding the slots
+ * from `first` on */
+static inline void put_edge(int *cols, double *values, int first, int slot, int offset, double c)
+{
+   if(slot >= first) {
+      cols[slot - first]   = offset;
+      values[slot - first] = -c;
+   }
+   cols[G_DIAGONAL - first]    = 0;
+   values[G_DIAGONAL - first] += c;
+}
+
+#define CARRY_SLOTS (G_DIAGONAL + 1)
+
+static inline void clear_carry(struct GRowStream *S, size_t t)
+{
+   size_t r = (t % S->ring) * CARRY_SLOTS;
+   int    s;
+   for(s = 0; s < CARRY_SLOTS; s++) {
+      S->cols[r + s]   = G_EMPTY;
+      S->values[r + s] = 0.;
+   }
+}
+
+/* The edges of row `m` to rows after it: the slot each takes in row
+ * `m`, the row `t` it reaches and its conductance.  Returns how many.
+ * In row `t` the same edge takes slot 8 - slot. */
+static int forward_edges(struct ConductanceGrid *G, size_t m, int *slot, size_t *t, double *c)
+{
+   const struct GEdges *e = G_edges(G, m);
+   size_t below = e->link >> G_LINK_SHIFT;
+   int    d, n = 0, skip = 0;
+
+   for(d = 0; d < G_NEDGES; d++) {
+      if(!(e->link & (1u << d)))
+         continue;
+      slot[n] = G_SLOT(edge_a[d], edge_b[d]);
+      /* the neighbours in the row below are numbered one after another */
+      t[n] = d == G_EAST ? m + 1 : m + below + skip++;
+      c[n] = e->value[d];
+      ++n;
+   }
+   return n;
+}
+
+/* Edge of conductance `c` reaching row `t` from `t - offset`, carried
+ * until row `t` is expanded */
+static inline void carry_edge(struct GRowStream *S, size_t t, int slot, int offset, double c)
+{
+   size_t r = (t % S->ring) * CARRY_SLOTS;
+   put_edge(&S->cols[r], &S->values[r], 0, slot, offset, c);
+}
+
+void G_stream_init(struct GRowStream *S, struct ConductanceGrid *G, size_t k, int upper)
+{
+   size_t m, t[G_NEDGES];
+   double c[G_NEDGES];
+   int    slot[G_NEDGES], e, n;
+
+   S->G = G;
+   S->next = k;
+   S->first = upper ? G_DIAGONAL : 0;
+   S->ring = G->reach + 1;
+   S->cols = (int *)malloc(sizeof(int) * S->ring * CARRY_SLOTS);
+   S->values = (double *)malloc(sizeof(double) * S->ring * CARRY_SLOTS);
+   for(m = 0; m < S->ring; m++)
+      clear_carry(S, m);
+   /* edges from before `k` reach at most `reach` rows on, so they all
+    * land in the ring */
+   for(m = k > G->reach ? k - G->reach : 0; m < k; m++) {
+      n = forward_edges(G, m, slot, t, c);
+      for(e = 0; e < n; e++) {
+         if(t[e] >= k)
+            carry_edge(S, t[e], 8 - slot[e], -(int)(t[e] - m), c[e]);
+      }
+   }
+}
+
+void G_stream_rows(struct GRowStream *S, size_t n, int *cols, double *values)
+{
+   struct ConductanceGrid *G = S->G;
+   int    width = 9 - S->first, slot[G_NEDGES], e, k, s;
+   size_t r, t[G_NEDGES];
+   double c[G_NEDGES];
+
+   for(r = 0; r < n; r++) {
+      size_t m = S->next + r;
+      size_t carry = (m % S->ring) * CARRY_SLOTS;
+      int    *row_cols   = &cols[r * width];
+      double *row_values = &values[r * width];
+
+      /* the edges from earlier rows, then this row's own */
+      for(s = S->first; s < 9; s++) {
+         row_cols[s - S->first]   = s < CARRY_SLOTS ? S->cols[carry + s] : G_EMPTY;
+         row_values[s - S->first] = s < CARRY_SLOTS ? S->values[carry + s] : 0.;
+      }
+      clear_carry(S, m);
+      k = forward_edges(G, m, slot, t, c);
+      for(e = 0; e < k; e++) {
+         put_edge(row_cols, row_values, S->first, slot[e], (int)(t[e] - m), c[e]);
+         carry_edge(S, t[e], 8 - slot[e], -(int)(t[e] - m), c[e]);
+      }
+   }
+   S->next += n;
+}
+
+void G_stream_free(struct GRowStream *S)
+{
+   free(S->cols);
+   free(S->values);
+}
+
+void G_rows(struct ConductanceGrid *G, size_t k, size_t n, int *cols, double *values)
+{
+   struct GRowStream S;
+   G_stream_init(&S, G, k, 0);
+   G_stream_rows(&S, n, cols, values);
+   G_stream_free(&S);
+}
+
+void G_upper(struct ConductanceGrid *G, size_t k, size_t n, int *cols, double *values)
+{
+   struct GRowStream S;
+   G_stream_init(&S, G, k, 1);
+   G_stream_rows(&S, n, cols, values);
+   G_stream_free(&S);
+}
@@ -17,15 +17,85 @@
 #ifndef CONDUCTANCE_H
 #define CONDUCTANCE_H
 
-// TODO: Update G to use these types.  It'll be cleaner
-typedef int G_cols_t[10];
-typedef double G_values_t[9];
+#include <stdint.h>
+
+#include "tiles.h"
+
+/* A cell keeps only the conductances of its edges to the neighbours
+ * numbered after it: east, then south-west, south and south-east in the
+ * raster row below.  Its other edges are its neighbours' forward edges
+ * and its diagonal is the sum of them all, so a cell takes 20 bytes
+ * instead of the 108 of nine columns and values. */
+enum { G_EAST, G_SOUTHWEST, G_SOUTH, G_SOUTHEAST, G_NEDGES };
+
+/* Bits of `link` below this are the edges present */
+#define G_LINK_SHIFT G_NEDGES
+
+struct GEdges
+{
+   float    value[G_NEDGES];
+   uint32_t link;   /* bit d set when edge d exists; above them, how many
+                       cells on the first neighbour in the row below is */
+};
 
 struct ConductanceGrid
 {
-   int nrows;           /* number of rows in the grid */
-   int   *cols;    /* the column indicies */
-   double *values;  /* all the values, 9xN */
+   size_t nrows;             /* number of rows in the grid */
+   size_t reach;             /* no edge spans more rows than this */
+   struct TileArray edges;   /* a struct GEdges per row */
 };
 
+static inline struct GEdges *G_edges(struct ConductanceGrid *G, size_t row)
+{
+   return (struct GEdges *)tile_at(&G->edges, row);
+}
+
+/* Rows are handed out with a slot per stencil direction, the neighbour
+ * at raster offset (a,b) in slot (a+1)*3 + (b+1) and the cell itself in
+ * the middle.  Columns are 32-bit offsets from their row, which a
+ * neighbour never more than a raster row and a cell away always fits.
+ * Cells are numbered in raster order, so the columns of a row come out
+ * sorted, and the diagonal and upper triangle are the last
+ * G_UPPER_SLOTS slots. */
+#define G_EMPTY INT_MIN   /* unused slot */
+#define G_SLOT(a,b)    (((a) + 1) * 3 + (b) + 1)
+#define G_DIAGONAL     G_SLOT(0,0)
+#define G_UPPER_SLOTS  5
+
+struct ResistanceGrid;
+
+/* Build the conductance matrix of the habitat's cells, a row per cell */
+PetscErrorCode init_conductance(struct ResistanceGrid *R, struct ConductanceGrid *G);
+void free_conductance(struct ConductanceGrid *G);
+
+/* Rows [k,k+n) of `G` in slots, 9 per row.  The edges into a row start
+ * up to `reach` rows before it, so every call reads those rows too; use
+ * a GRowStream to expand a run of rows a piece at a time. */
+void G_rows(struct ConductanceGrid *G, size_t k, size_t n, int *cols, double *values);
+
+/* The same keeping the diagonal and upper triangle only, G_UPPER_SLOTS
+ * per row in the same order */
+void G_upper(struct ConductanceGrid *G, size_t k, size_t n, int *cols, double *values);
+
+/* Consecutive rows expanded in pieces.  The `reach` rows before the
+ * first are read once, when the stream starts; after that each row's
+ * edges back to earlier rows are carried forward from where they were
+ * read, in a ring of reach + 1 rows of the slots up to the diagonal. */
+struct GRowStream
+{
+   struct ConductanceGrid *G;
+   size_t  next;      /* first row not expanded yet */
+   int     first;     /* first slot handed out: 0, or G_DIAGONAL */
+   size_t  ring;      /* rows in the carry */
+   int    *cols;      /* G_DIAGONAL + 1 per row, row t at t % ring */
+   double *values;
+};
+
+/* From row `k`, in 9 slots per row or, when `upper` is set, the upper
+ * triangle's G_UPPER_SLOTS */
+void G_stream_init(struct GRowStream *S, struct ConductanceGrid *G, size_t k, int upper);
+/* The next `n` rows */
+void G_stream_rows(struct GRowStream *S, size_t n, int *cols, double *values);
+void G_stream_free(struct GRowStream *S);
+
 #endif  /* CONDUCTANCE_H */
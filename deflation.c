@@ -0,0 +1,285 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <petsc.h>
+#include <petscblaslapack.h>
+
+#include "deflation.h"
+#include "util.h"
+
+PetscInt deflation_vectors = 0;
+PetscInt deflation_harvest = 0;
+
+/* A direction is dropped when orthogonalising leaves less than this
+ * fraction of it */
+#define DROP_TOLERANCE 1e-8
+
+/* One matrix per rank, so one set of vectors */
+static struct
+{
+   Mat    A;
+   PC     inner;           /* M, set up from the options */
+   Vec   *Z, *AZ, *T;      /* deflation_vectors each; T is scratch for the next Z */
+   Vec   *Y, *AY;          /* preconditioned residuals of this solve */
+   Vec    t;
+   int    k, m;            /* room in Z and in Y */
+   int    nz, ny;          /* vectors in Z and in Y */
+   int    nused;           /* vectors deflated in this solve */
+   PetscScalar  *E, *c, *d;
+   PetscBLASInt *pivots;
+} D = { NULL };
+
+static PetscErrorCode alloc_vectors(Mat A)
+{
+   PetscErrorCode ierr;
+
+   D.k = (int)deflation_vectors;
+   D.m = (int)(deflation_harvest > 0 ? deflation_harvest : deflation_vectors);
+   ierr = MatCreateVecs(A, &D.t, NULL);            CHKERRQ(ierr);
+   ierr = VecDuplicateVecs(D.t, D.k, &D.Z);        CHKERRQ(ierr);
+   ierr = VecDuplicateVecs(D.t, D.k, &D.AZ);       CHKERRQ(ierr);
+   ierr = VecDuplicateVecs(D.t, D.k, &D.T);        CHKERRQ(ierr);
+   ierr = VecDuplicateVecs(D.t, D.m, &D.Y);        CHKERRQ(ierr);
+   ierr = VecDuplicateVecs(D.t, D.m, &D.AY);       CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(PetscScalar) * D.k * D.k, &D.E);       CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(PetscScalar) * D.k, &D.c);             CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(PetscScalar) * D.k, &D.d);             CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(PetscBLASInt) * D.k, &D.pivots);       CHKERRQ(ierr);
+   D.nz = D.ny = D.nused = 0;
+   return 0;
+}
+
+/* E = Z' A Z for this pair's matrix, factored */
+static PetscErrorCode pc_setup(PC pc)
+{
+   PetscBLASInt n = D.nz, info;
+   int i;
+   PetscErrorCode ierr;
+
+   ierr = PCSetUp(D.inner);  CHKERRQ(ierr);
+   D.nused = 0;
+   for(i = 0; i < D.nz; i++) {
+      ierr = MatMult(D.A, D.Z[i], D.AZ[i]);                  CHKERRQ(ierr);
+      ierr = VecMDot(D.AZ[i], D.nz, D.Z, &D.E[i * D.nz]);    CHKERRQ(ierr);
+   }
+   if(D.nz > 0) {
+      LAPACKgetrf_(&n, &n, D.E, &n, D.pivots, &info);
+      if(info == 0)
+         D.nused = D.nz;
+   }
+   return 0;
+}
+
+/* y = P' M^-1 P r + Q r with Q = Z E^-1 Z' and P = I - A Q, using
+ * Z' A = (A Z)' so that deflating costs no extra product with A.  While
+ * there is room, y and A y are kept for the next Z. */
+static PetscErrorCode pc_apply(PC pc, Vec r, Vec y)
+{
+   PetscBLASInt n = D.nused, one = 1, info;
+   int i;
+   PetscErrorCode ierr;
+
+   if(D.nused == 0) {
+      ierr = PCApply(D.inner, r, y);  CHKERRQ(ierr);
+   }
+   else {
+      ierr = VecMDot(r, D.nused, D.Z, D.c);         CHKERRQ(ierr);
+      LAPACKgetrs_("N", &n, &one, D.E, &n, D.pivots, D.c, &n, &info);
+      for(i = 0; i < D.nused; i++)
+         D.d[i] = -D.c[i];
+      ierr = VecCopy(r, D.t);                       CHKERRQ(ierr);
+      ierr = VecMAXPY(D.t, D.nused, D.d, D.AZ);     CHKERRQ(ierr);
+      ierr = PCApply(D.inner, D.t, y);              CHKERRQ(ierr);
+      ierr = VecMDot(y, D.nused, D.AZ, D.d);        CHKERRQ(ierr);
+      LAPACKgetrs_("N", &n, &one, D.E, &n, D.pivots, D.d, &n, &info);
+      for(i = 0; i < D.nused; i++)
+         D.d[i] = D.c[i] - D.d[i];
+      ierr = VecMAXPY(y, D.nused, D.d, D.Z);        CHKERRQ(ierr);
+   }
+   if(D.ny < D.m) {
+      ierr = VecCopy(y, D.Y[D.ny]);               CHKERRQ(ierr);
+      ierr = MatMult(D.A, y, D.AY[D.ny]);         CHKERRQ(ierr);
+      ++D.ny;
+   }
+   return 0;
+}
+
+static PetscErrorCode pc_destroy(PC pc)
+{
+   return PCDestroy(&D.inner);
+}
+
+PetscErrorCode deflation_setup(KSP ksp, Mat A, const char *prefix)
+{
+   PC pc;
+   PetscErrorCode ierr;
+
+   if(D.t == NULL) {
+      ierr = alloc_vectors(A);  CHKERRQ(ierr);
+   }
+   D.A = A;
+   D.ny = 0;
+   ierr = PCCreate(PetscObjectComm((PetscObject)ksp), &D.inner);  CHKERRQ(ierr);
+   ierr = PCSetOptionsPrefix(D.inner, prefix);  CHKERRQ(ierr);
+   ierr = PCSetOperators(D.inner, A, A);        CHKERRQ(ierr);
+   ierr = PCSetFromOptions(D.inner);            CHKERRQ(ierr);
+
+   ierr = KSPGetPC(ksp, &pc);                   CHKERRQ(ierr);
+   ierr = PCSetType(pc, PCSHELL);               CHKERRQ(ierr);
+   ierr = PCShellSetSetUp(pc, pc_setup);        CHKERRQ(ierr);
+   ierr = PCShellSetApply(pc, pc_apply);        CHKERRQ(ierr);
+   ierr = PCShellSetDestroy(pc, pc_destroy);    CHKERRQ(ierr);
+   ierr = PCShellSetName(pc, "deflation");      CHKERRQ(ierr);
+   return 0;
+}
+
+/* Orthonormalise V (two passes of classical Gram-Schmidt), applying
+ * the same steps to W so that W stays A V.  Returns how many are kept;
+ * V and W are compacted to them. */
+static int orthonormalise(Vec *V, Vec *W, int n, PetscScalar *h)
+{
+   int i, j, pass, keep = 0;
+
+   for(j = 0; j < n; j++) {
+      PetscReal before, after;
+      Vec v = V[j], w = W[j];
+      VecNorm(v, NORM_2, &before);
+      for(pass = 0; pass < 2 && keep > 0; pass++) {
+         VecMDot(v, keep, V, h);
+         for(i = 0; i < keep; i++)
+            h[i] = -h[i];
+         VecMAXPY(v, keep, h, V);
+         VecMAXPY(w, keep, h, W);
+      }
+      VecNorm(v, NORM_2, &after);
+      if(!(after > DROP_TOLERANCE * before))
+         continue;
+      VecScale(v, 1. / after);
+      VecScale(w, 1. / after);
+      V[j] = V[keep];
+      W[j] = W[keep];
+      V[keep] = v;
+      W[keep] = w;
+      ++keep;
+   }
+   return keep;
+}
+
+/* Rayleigh-Ritz on V = [Z Y]: the eigenvectors of V' A V with the
+ * smallest eigenvalues, in magnitude, become the next Z.  A pair's
+ * matrix has one diagonal entry zeroed, so it need not be definite;
+ * the plain rather than the harmonic projection keeps the small
+ * eigenproblem symmetric. */
+PetscErrorCode deflation_update(int converged)
+{
+   Vec         *V, *W;
+   PetscScalar *H, *work;
+   PetscReal   *theta;
+   int         *order;
+   int          i, j, n, nkeep;
+   PetscBLASInt bn, lwork, info;
+   PetscErrorCode ierr;
+
+   if(!converged || D.ny == 0 || D.t == NULL) {
+      D.ny = 0;
+      return 0;
+   }
+   n = D.nz + D.ny;
+   ierr = PetscMalloc(sizeof(Vec) * n, &V);                  CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(Vec) * n, &W);                  CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(PetscScalar) * n * n, &H);      CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(PetscScalar) * 3 * n, &work);   CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(PetscReal) * n, &theta);        CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(int) * n, &order);              CHKERRQ(ierr);
+   for(i = 0; i < D.nz; i++) {
+      V[i] = D.Z[i];
+      W[i] = D.AZ[i];
+   }
+   for(i = 0; i < D.ny; i++) {
+      V[D.nz + i] = D.Y[i];
+      W[D.nz + i] = D.AY[i];
+   }
+   n = orthonormalise(V, W, n, work);
+
+   for(j = 0; j < n; j++)
+      VecMDot(W[j], n, V, &H[j * n]);
+   for(j = 0; j < n; j++) {
+      for(i = 0; i < j; i++)
+         H[i + j * n] = H[j + i * n] = 0.5 * (H[i + j * n] + H[j + i * n]);
+   }
+   bn = n;
+   lwork = 3 * MAX(n, 1);
+   info = 0;
+   if(n > 0)
+      LAPACKsyev_("V", "U", &bn, H, &bn, theta, work, &lwork, &info);
+
+   nkeep = 0;
+   if(n > 0 && info == 0) {
+      /* by magnitude; n is small */
+      for(i = 0; i < n; i++) {
+         for(j = i; j > 0 && fabs(theta[order[j-1]]) > fabs(theta[i]); j--)
+            order[j] = order[j-1];
+         order[j] = i;
+      }
+      nkeep = MIN(n, D.k);
+      for(i = 0; i < nkeep; i++) {
+         VecSet(D.T[i], 0.);
+         VecMAXPY(D.T[i], n, &H[order[i] * n], V);
+      }
+   }
+   if(nkeep > 0) {
+      Vec *swap = D.Z;
+      D.Z = D.T;
+      D.T = swap;
+      D.nz = nkeep;
+   }
+   D.ny = 0;
+
+   PetscFree(V);
+   PetscFree(W);
+   PetscFree(H);
+   PetscFree(work);
+   PetscFree(theta);
+   PetscFree(order);
+   return 0;
+}
+
+int deflation_size()
+{
+   return D.nused;
+}
+
+void deflation_free()
+{
+   if(D.t == NULL)
+      return;
+   VecDestroyVecs(D.k, &D.Z);
+   VecDestroyVecs(D.k, &D.AZ);
+   VecDestroyVecs(D.k, &D.T);
+   VecDestroyVecs(D.m, &D.Y);
+   VecDestroyVecs(D.m, &D.AY);
+   VecDestroy(&D.t);
+   PetscFree(D.E);
+   PetscFree(D.c);
+   PetscFree(D.d);
+   PetscFree(D.pivots);
+   memset(&D, 0, sizeof(D));
+}
@@ -0,0 +1,46 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef DEFLATION_H
+#define DEFLATION_H
+
+#include "util.h"
+
+extern PetscInt deflation_vectors;   /* -deflation_vectors, 0 turns deflation off */
+extern PetscInt deflation_harvest;   /* -deflation_harvest, 0 takes deflation_vectors */
+
+/* Deflated CG over the sequence of pairs, whose matrices differ in one
+ * diagonal entry.  The preconditioner set up from the options, M, is
+ * wrapped so that the directions in Z, approximate eigenvectors of the
+ * smallest eigenvalues carried over from earlier solves, are solved for
+ * exactly at every step.  With E = Z' A Z, Q = Z E^-1 Z' and P = I - A Q
+ * the preconditioner is P' M^-1 P + Q (balancing Neumann-Neumann), which
+ * stays symmetric, so CG can use it from any starting vector.
+ *
+ * After each solve Z is replaced by the Ritz vectors of the smallest
+ * Ritz values in the space of Z and the first preconditioned residuals
+ * of the solve.  A rank holds 3 deflation_vectors + 2 deflation_harvest
+ * vectors of its rows.
+ *
+ * deflation_setup() goes after KSPSetFromOptions() and before
+ * KSPSetUp(); deflation_update() after the solve. */
+PetscErrorCode deflation_setup(KSP ksp, Mat A, const char *prefix);
+PetscErrorCode deflation_update(int converged);
+int            deflation_size();    /* directions deflated in the last solve */
+void           deflation_free();
+
+#endif  /* DEFLATION_H */
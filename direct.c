@@ -0,0 +1,220 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <petsc.h>
+
+#include "direct.h"
+#include "solver.h"
+#include "util.h"
+
+PetscBool direct_solves = PETSC_FALSE;
+PetscReal direct_memory = 0.;
+
+/* Nested dissection of a k x k grid with the 9-point stencil leaves
+ * about 31/4 n log2 n entries in the factor (George, 1973) */
+#define FILL_COEFFICIENT 7.75
+/* room for the solver's work space on top of the factor itself */
+#define FILL_HEADROOM    1.5
+
+static int node_ranks = 1;   /* ranks sharing this rank's memory */
+
+/* One matrix per rank, so one factor */
+static struct
+{
+   KSP       ksp;
+   Mat       L;             /* the conductances, each component grounded */
+   PetscInt *starts;        /* first row of each component */
+   int       ncomponents;
+   PetscInt  count;
+   int       ready;
+} F = { NULL };
+
+void direct_init()
+{
+   MPI_Comm node;
+   PetscBool flg;
+
+   PetscOptionsGetBool(PETSC_NULL, NULL, "-direct",        &direct_solves, &flg);
+   PetscOptionsGetReal(PETSC_NULL, NULL, "-direct_memory", &direct_memory, &flg);
+   if(!direct_solves)
+      return;
+   MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+   MPI_Comm_size(node, &node_ranks);
+   MPI_Comm_free(&node);
+   /* every pair takes the same time, there is nothing to tune */
+   autotune = PETSC_FALSE;
+}
+
+/* Bytes per rank the factor of `count` rows on `nranks` ranks needs */
+static double factor_bytes(PetscInt count, int nranks)
+{
+   double n = (double)MAX(count, 2);
+   double entries = FILL_COEFFICIENT * n * log2(n) + 9. * n;
+   return FILL_HEADROOM * entries * (sizeof(PetscScalar) + sizeof(PetscInt)) / nranks;
+}
+
+/* Bytes this rank may give the factor: -direct_memory, otherwise half
+ * the memory now free on the node shared among its ranks */
+static double memory_budget()
+{
+   if(direct_memory > 0.)
+      return direct_memory * 1024. * 1024.;
+   return 0.5 * (double)sysconf(_SC_AVPHYS_PAGES) * (double)sysconf(_SC_PAGESIZE) / node_ranks;
+}
+
+/* `starts` holds the first row of each of the `ncomponents` components
+ * of A, in order */
+PetscErrorCode direct_factor(Mat A, const PetscInt *starts, int ncomponents)
+{
+   MPI_Comm  comm;
+   PC        pc;
+   PetscInt  row_start, row_end, count;
+   PetscScalar d;
+   double    need, t;
+   int       c, grank, gsize, fits, ok;
+   PetscErrorCode ierr, err;
+
+   if(!direct_solves)
+      return 0;
+   comm = PetscObjectComm((PetscObject)A);
+   MPI_Comm_rank(comm, &grank);
+   MPI_Comm_size(comm, &gsize);
+   ierr = MatGetSize(A, &count, NULL);  CHKERRQ(ierr);
+
+   need = factor_bytes(count, gsize);
+   fits = need <= memory_budget();
+   MPI_Allreduce(MPI_IN_PLACE, &fits, 1, MPI_INT, MPI_LAND, comm);
+   if(!fits) {
+      if(grank == 0)
+         message("Direct: a factor of %ld rows needs about %.0lf MB per rank, more than there is; solving iteratively.\n",
+                 (long)count, need / (1024. * 1024.));
+      return 0;
+   }
+
+   t = microtime();
+   ierr = MatAssemblyBegin(A, MAT_FINAL_ASSEMBLY);       CHKERRQ(ierr);
+   ierr = MatAssemblyEnd(A, MAT_FINAL_ASSEMBLY);         CHKERRQ(ierr);
+   ierr = MatDuplicate(A, MAT_COPY_VALUES, &F.L);        CHKERRQ(ierr);
+   ierr = MatGetOwnershipRange(F.L, &row_start, &row_end);  CHKERRQ(ierr);
+   for(c = 0; c < ncomponents; c++) {
+      if(starts[c] >= row_start && starts[c] < row_end) {
+         ierr = MatGetValue(F.L, starts[c], starts[c], &d);             CHKERRQ(ierr);
+         ierr = MatSetValue(F.L, starts[c], starts[c], d, ADD_VALUES);  CHKERRQ(ierr);
+      }
+   }
+   ierr = MatAssemblyBegin(F.L, MAT_FINAL_ASSEMBLY);     CHKERRQ(ierr);
+   ierr = MatAssemblyEnd(F.L, MAT_FINAL_ASSEMBLY);       CHKERRQ(ierr);
+
+   ierr = KSPCreate(comm, &F.ksp);                       CHKERRQ(ierr);
+   ierr = KSPSetOptionsPrefix(F.ksp, "direct_");         CHKERRQ(ierr);
+   ierr = KSPSetOperators(F.ksp, F.L, F.L);              CHKERRQ(ierr);
+   ierr = KSPSetType(F.ksp, KSPPREONLY);                 CHKERRQ(ierr);
+   ierr = KSPGetPC(F.ksp, &pc);                          CHKERRQ(ierr);
+   ierr = PCSetType(pc, PCCHOLESKY);                     CHKERRQ(ierr);
+   ierr = PCFactorSetMatSolverPackage(pc, gsize == 1 ? MATSOLVERPETSC : MATSOLVERMUMPS);  CHKERRQ(ierr);
+   ierr = PCFactorSetMatOrderingType(pc, MATORDERINGND); CHKERRQ(ierr);
+   ierr = KSPSetFromOptions(F.ksp);                      CHKERRQ(ierr);
+
+   /* a failed factorisation leaves the iterative solver in charge
+    * rather than stopping the run */
+   PetscPushErrorHandler(PetscReturnErrorHandler, NULL);
+   err = KSPSetUp(F.ksp);
+   PetscPopErrorHandler();
+   ok = err == 0;
+   MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, comm);
+   if(!ok) {
+      if(grank == 0)
+         message("Direct: factoring %ld rows failed; solving iteratively.\n", (long)count);
+      direct_free();
+      return 0;
+   }
+
+   ierr = PetscMalloc(sizeof(PetscInt) * MAX(ncomponents, 1), &F.starts);  CHKERRQ(ierr);
+   memcpy(F.starts, starts, sizeof(PetscInt) * ncomponents);
+   F.ncomponents = ncomponents;
+   F.count = count;
+   F.ready = 1;
+   if(grank == 0)
+      message("Direct: factored %ld rows in %d component(s) in %.2lf s.\n",
+              (long)count, ncomponents, microtime() - t);
+   return 0;
+}
+
+int direct_ready()
+{
+   return F.ready;
+}
+
+/* Rows [lo,hi) of the component holding `row` */
+static void component_rows(PetscInt row, PetscInt *lo, PetscInt *hi)
+{
+   int a = 0, b = F.ncomponents;
+   while(b - a > 1) {
+      int mid = (a + b) / 2;
+      if(F.starts[mid] <= row)
+         a = mid;
+      else
+         b = mid;
+   }
+   *lo = F.starts[a];
+   *hi = a + 1 < F.ncomponents ? F.starts[a + 1] : F.count;
+}
+
+PetscErrorCode direct_solve(Vec b, Vec x, PetscInt destnode, double *stats)
+{
+   KSPConvergedReason reason;
+   PetscInt     row_start, row_end, lo, hi, i;
+   PetscScalar *v;
+   double       ground = 0., t;
+   PetscErrorCode ierr;
+
+   t = microtime();
+   ierr = KSPSolve(F.ksp, b, x);  CHKERRQ(ierr);
+
+   /* ground the destination: shift its component so it sits at 0 */
+   component_rows(destnode, &lo, &hi);
+   ierr = VecGetOwnershipRange(x, &row_start, &row_end);  CHKERRQ(ierr);
+   ierr = VecGetArray(x, &v);  CHKERRQ(ierr);
+   if(destnode >= row_start && destnode < row_end)
+      ground = v[destnode - row_start];
+   MPI_Allreduce(MPI_IN_PLACE, &ground, 1, MPI_DOUBLE, MPI_SUM, PetscObjectComm((PetscObject)x));
+   for(i = MAX(lo, row_start); i < MIN(hi, row_end); i++)
+      v[i - row_start] -= ground;
+   ierr = VecRestoreArray(x, &v);  CHKERRQ(ierr);
+
+   KSPGetConvergedReason(F.ksp, &reason);
+   stats[SOLVE_SOLVE_TIME] = microtime() - t;
+   stats[SOLVE_ITERATIONS] = 0;
+   stats[SOLVE_REASON] = reason;
+   return 0;
+}
+
+void direct_free()
+{
+   if(F.ksp)
+      KSPDestroy(&F.ksp);
+   if(F.L)
+      MatDestroy(&F.L);
+   if(F.starts)
+      PetscFree(F.starts);
+   memset(&F, 0, sizeof(F));
+}
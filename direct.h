@@ -0,0 +1,44 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef DIRECT_H
+#define DIRECT_H
+
+#include "util.h"
+
+extern PetscBool direct_solves;   /* -direct */
+extern PetscReal direct_memory;   /* -direct_memory, MB per rank for the factor; 0 guesses */
+
+/* With -direct a group factors its matrix once and answers every pair
+ * with a forward and a back substitution.  The factor cannot depend on
+ * the pair, so rather than the destination each component is grounded
+ * at its first row, by doubling that diagonal entry.  Ground voltages
+ * only differ by a constant within a component, so shifting the
+ * solution to put the destination at 0 gives what solving with the
+ * destination grounded would have.
+ *
+ * Cholesky with a nested dissection ordering, from PETSc on one rank
+ * and MUMPS on several, set up under the prefix "direct_".  When the
+ * factor would not fit in memory, or factoring fails, the group keeps
+ * solving iteratively. */
+void           direct_init();
+PetscErrorCode direct_factor(Mat A, const PetscInt *starts, int ncomponents);
+int            direct_ready();
+PetscErrorCode direct_solve(Vec b, Vec x, PetscInt destnode, double *stats);
+void           direct_free();
+
+#endif  /* DIRECT_H */
@@ -56,8 +56,100 @@ date
 		# Set Convergence Factor to stop calculating. Typically used in place of 'node_pairs' or if all pairwise is too
 		# computationally time consuming. Acceptable formats include: '4N' or '.9999'. Set to '1N' Below. If omitted, gflow will
 		# calculate all pairwise
+	# -converge_rse
+		# Stop once the estimated relative standard error of the summed current density drops below this value in
+		# every high-flow cell (cells whose mean density is at least -rse_flow_fraction, default 0.1, of the largest).
+		# Best combined with -shuffle_node_pairs. Not used below.
+	# -output_uncertainty_filename
+		# Write the per-cell relative standard error of the summation (same formats as -output_sum_density_filename).
 	# -shuffle_node_pairs
 		# Shuffles pairs for random selection. Input is binary. Currently set to shuffle below (= 1)
+	# -locality_order
+		# Order pairs by source node and then by sink, with nodes taken along a Z-order curve, so consecutive pairs share a
+		# source and nearby sinks. Pair numbers (as used by -range) change. Combined with -shuffle_node_pairs, pairs are
+		# shuffled in blocks of -shuffle_block (default 64, or 1 without -locality_order) so each block keeps its order
+		# and the pairs solved before an early stop are still a random sample of blocks.
+	# -seed
+		# Seed for -shuffle_node_pairs and -adaptive_sampling (64-bit integer). Defaults to the current time; the seed
+		# in use is printed so a run can be reproduced.
+	# -adaptive_sampling
+		# Draw pairs from strata of distance class (-sample_distance_classes, default 8) and source node group
+		# (-sample_node_groups, default 4), favouring strata whose pairs change the summed map the most. Each pair is
+		# drawn with replacement, so it may be solved more than once, and weighted by its share of the pairs over its
+		# chance of being drawn (Hansen-Hurwitz), so that the summed map after n draws is an unbiased estimate of n/N
+		# times the sum over all N pairs. -sample_exploration (default 0.1) is the share of draws kept proportional to
+		# stratum size. Use with -converge_at or -converge_rse. Unlike the default pair order this keeps a list of all
+		# pairs, 8 bytes per pair (24 while the strata are built).
+	# -threads
+		# Number of threads rank 0 uses for its raster passes: reading the habitat, island removal, building the conductance
+		# matrix, computing and summing the current density and writing .asc maps (default 1). Only rank 0 reads it; the
+		# solver ranks take their threads, if any, from the PETSc/hypre build (e.g. OMP_NUM_THREADS). Passes over tiled
+		# arrays (-tile_rows) stay on one thread.
+	# -output_labels_filename
+		# Write the 8-connected habitat component of every cell (.asc), before islands are discarded.
+	# -keep_components
+		# Instead of keeping only the largest habitat patch, keep every patch that holds a focal node and solve each as its
+		# own system. Pairs between different patches are reported with infinite effective resistance without solving.
+	# -component_groups
+		# With -keep_components, split the workers into this many groups so small patches are solved concurrently with
+		# the largest one (default 1).
+	# -prefetch_pairs
+		# Number of pairs queued at each worker group (default 2), so a group starts its next pair as soon as it has
+		# returned a solution, while rank 0 is still writing the previous one.
+	# -manager_solves
+		# Whether rank 0 also owns rows of the first worker group's matrix and solves, handling results between its
+		# solves (default 1). Set to 0 to keep rank 0 free for its raster work on large runs. A single process
+		# (mpiexec -n 1, or ./gflow.x on its own) always solves.
+	# -perf_report
+		# Write a JSON report at exit: every rank's time per phase (parse, islands, conductance, distribute, ksp_setup,
+		# ksp_solve, gather, current, accumulate, output, idle), solves, KSP iterations, bytes GFlow sent and received over
+		# MPI and peak RSS, plus the KSP iterations per pair. A high manager_idle_fraction means the solver limits the run; a
+		# high worker_idle_fraction means rank 0 does. Phases are also PETSc log stages, so -log_view shows them.
+	# -perf_report_interval
+		# Also rewrite the report, with rank 0's counters only, every this many pairs (default 0, at exit only).
+	# -perf_trace
+		# Record every rank's phases, sends and receives on a timeline and write them, merged, to this file at exit in
+		# Chrome's trace format; open it at https://ui.perfetto.dev. -perf_trace_events (default 1048576) caps the
+		# events kept per rank.
+	# -solver_log
+		# Write a CSV line per solved pair: worker group, solver configuration, KSP iterations, converged reason, final
+		# residual norm, setup and solve time, and whether it had to be solved again. Pairs that fail to converge are
+		# also reported in the log.
+	# -solve_accuracy
+		# Stop each solve once its result is as accurate as the outputs can show, instead of at -ksp_atol: no cell's
+		# current off by more than this many amps (of the 1 A injected) or -output_threshold, whichever is larger, and the
+		# effective resistance right to its last printed decimal. Each result is checked with one extra matrix product
+		# and the solve continued if it falls short; the tolerance of later solves adapts to how the last one did.
+		# Values much below 1e-7 are beyond the precision of the float maps. Default 0 (use the KSP tolerances).
+	# -autotune
+		# Try a set of preconditioners (BoomerAMG with other strength thresholds, HMIS coarsening or l1 smoothing, GAMG,
+		# block Jacobi with ICC) against the command line's on the first pairs, -autotune_trials (default 1) pairs
+		# each, then solve the rest with the fastest that converged. A pair whose candidate fails is solved again with
+		# the command line's settings. Candidates keep the command line's -ksp_* tolerances.
+	# -symmetric_storage
+		# Store only the upper triangle of each matrix (SBAIJ) and send workers only those 5 of each row's 9 entries:
+		# about 45% less matrix memory and traffic per product. hypre and GAMG need the full matrix, so they are
+		# replaced by block Jacobi with incomplete Cholesky, and -autotune is ignored.
+	# -direct
+		# Factor each group's matrix once (Cholesky, nested dissection ordering; MUMPS when the group has several
+		# ranks) and solve every pair with two triangular solves. Suits mid-sized rasters with many pairs. Falls back to
+		# the iterative solver when the factor would not fit in memory or factoring fails. -autotune is ignored.
+		# Options under the prefix direct_ (e.g. -direct_pc_factor_mat_ordering_type) adjust the factorisation.
+	# -direct_memory
+		# Megabytes per rank the factor may use (default half the node's free memory shared among its ranks).
+	# -deflation_vectors
+		# Carry this many approximate eigenvectors of the smallest eigenvalues from one pair's solve to the next and
+		# solve for them exactly in every CG step (default 0, off). Each solve refines them from its first
+		# -deflation_harvest (default -deflation_vectors) preconditioned residuals. Costs 3 * vectors + 2 * harvest
+		# vectors of each rank's rows; the deflated column of -solver_log shows how many were used.
+	# -node_shared
+		# Ranks on rank 0's node read their matrix rows straight from rank 0's conductance arrays, kept once in an
+		# MPI-3 shared-memory window, instead of being sent copies. Not with -tile_rows.
+	# -tile_rows
+		# Keep the habitat, component labels, conductances, voltages and outputs in scratch files on rank 0 and map them
+		# this many raster rows at a time, so grids larger than memory can be prepared and written (default 0, all in
+		# memory). -tile_cache (default 16) is the number of tiles mapped at once per array and -tile_directory (default .)
+		# is where the scratch files go; they are removed on exit. Raster passes run on one thread when tiled.
 	# -effective_resistance
 		# Print effective resistance to log file. Supply path for .csv
 
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 #include <math.h>
 #include <float.h>
 #include <zlib.h>
@@ -29,12 +30,34 @@
 #include "nodelist.h"
 #include "habitat.h"
 #include "conductance.h"
+#include "deflation.h"
+#include "direct.h"
 #include "output.h"
+#include "perf.h"
+#include "sampler.h"
+#include "solver.h"
+#include "threads.h"
+#include "tiles.h"
 #include "util.h"
 
 #define MPI_SIZE_T MPI_UINT64_T
 
+/* Keeps every message's element count (9 per row) within an int */
+#define MAX_MESSAGE_ROWS (1 << 24)
+
+/* Rows expanded from the conductance grid and sent at a time */
+#define PACK_ROWS (1 << 16)
+
 static PetscReal converge_at = 1.;
+static PetscReal converge_rse = 0.;
+static PetscInt  component_groups = 1;
+static PetscInt  prefetch_pairs = 2;   /* pairs queued at each worker group */
+static PetscBool manager_solves = PETSC_TRUE;  /* rank 0 owns rows of group 0 */
+
+/* How often the manager looks at its workers, and for the killswitch,
+ * while it waits */
+#define POLL_INTERVAL       1000   /* microseconds */
+#define KILLSWITCH_INTERVAL 1.     /* seconds */
 
 static char common_options[] =
    "-ksp_type cg "
@@ -46,7 +69,12 @@ static char common_options[] =
 
 
 static char      habitat_file[PATH_MAX] = { 0 };
-static MPI_Comm  COMM_WORKERS;
+static MPI_Comm  COMM_GROUP = MPI_COMM_NULL;  /* ranks solving the same components */
+static MPI_Comm  COMM_NODE  = MPI_COMM_NULL;  /* ranks sharing rank 0's memory, with -node_shared */
+
+/* Rows are sent to and from the manager in runs that never cross one of
+ * its tiles, so every message lands in a single mapping */
+static size_t    chunk_rows;
 
 /* May be set to TRUE when the USR1 signal is caught.  Write
  * out the current result at the end of the iteration
@@ -58,16 +86,81 @@ enum {
    TAG_ROW_RANGE,
    TAG_COL_VALUES,
    TAG_RESULT,
+   TAG_PAIR,
+   TAG_DONE,
 };
 
 struct RowRange
 {
-   int start, end;
+   PetscInt start, end;
 };
 
+/* The pairs to solve, in order: those listed with -range, otherwise
+ * every pair (`seq` is NULL) */
 struct NodePairSequence
 {
-   int *seq, count;
+   PetscInt *seq;
+   size_t    count;
+};
+
+/* A set of worker ranks that solves the components numbered [start,end).
+ * Stored as longs so the table can be broadcast as one array */
+struct WorkerGroup
+{
+   long start, end;
+   long first_rank, nranks;
+};
+
+/* A pair handed to a worker group */
+struct InFlight
+{
+   long     index;     /* pair index, -1 when the group is idle */
+   struct Pair pair;
+   PetscInt nodes[2];
+   PetscInt message[4];   /* nodes, pair id and solver configuration, as sent */
+   MPI_Request request;
+   size_t rows[2];   /* rows of the pair's component */
+   size_t stratum;
+   double weight;
+};
+
+/* Pairs waiting for a worker group when there is more than one.  The
+ * pair sequence is read once, in order, and each pair is classified
+ * once and queued for the group owning its component, so the pairs
+ * handed out are always a prefix of the sequence apart from those still
+ * queued.  At most QUEUE_ROUNDS * prefetch_pairs pairs per group are
+ * queued in all; a group finding its own queue empty once that many are
+ * waiting for the others waits for them to catch up rather than reading
+ * further ahead. */
+#define QUEUE_ROUNDS 4
+
+struct PairQueue
+{
+   long  *pairs;
+   size_t head, count, size;   /* pairs[head..count) are waiting */
+};
+
+/* Pairs sent to a worker group and not yet returned, oldest first.  Up
+ * to `prefetch_pairs` wait at the group, so it starts on the next pair
+ * as soon as it finishes one, whatever the manager is doing. */
+struct Pipeline
+{
+   struct InFlight *slots;
+   int      head, count;
+   int      more;      /* 0 once the group has run out of pairs */
+   int      solved;    /* rank 0 has solved the oldest pair itself */
+   double   done[SOLVE_NSTATS];   /* the group's report on the pair it
+                                    has solved, starting with its id */
+};
+
+/* A worker's share of a solution, sent from a copy without waiting so
+ * the next solve can start while the manager receives it */
+struct ResultSend
+{
+   double      *values;
+   MPI_Request *requests;
+   int          nrequests;
+   double       done[SOLVE_NSTATS];
 };
 
 
@@ -75,11 +168,12 @@ static void parse_args()
 {
    const char *output_formats[3] = {  "asc", "asc.gz", "amp" };
    char convergence[PATH_MAX] = { 0 };
+   char seed[PATH_MAX] = { 0 };
 
    // Former globals. Will be removed in future release.
    char      output_directory[PATH_MAX] = ".";
    char      output_prefix[PATH_MAX] = { 0 };
-   int       output_format = -1;
+   PetscInt  output_format = -1;
    PetscBool output_final_current_only = PETSC_FALSE;
    
 #define DEPRICATED(SW) if(flg) fprintf(stderr, "Use of the `" SW "` switch is depricated and will be removed in a future release.  Please use the `output_density_filename` and `output_sum_density_filename` switches instead\n");
@@ -100,13 +194,40 @@ static void parse_args()
    PetscOptionsGetBool(PETSC_NULL,   NULL, "-nearest_first",   &nearest_first,              &flg);
    PetscOptionsGetBool(PETSC_NULL,   NULL, "-furthest_first",  &furthest_first,             &flg);
    PetscOptionsGetInt(PETSC_NULL,   NULL, "-shuffle_node_pairs",  &shuffle_node_pairs,             &flg);
+   PetscOptionsGetBool(PETSC_NULL,   NULL, "-locality_order",  &locality_order,             &flg);
+   PetscOptionsGetInt(PETSC_NULL,    NULL, "-shuffle_block",   &shuffle_block,              &flg);
+   PetscOptionsGetString(PETSC_NULL, NULL, "-seed",             seed,        PATH_MAX, &flg);
+   if(flg)
+      random_seed = strtoull(seed, NULL, 0);
+   else
+      random_seed = (uint64_t)time(NULL);
+   PetscOptionsGetBool(PETSC_NULL,   NULL, "-adaptive_sampling", &adaptive_sampling,        &flg);
+   PetscOptionsGetInt(PETSC_NULL,    NULL, "-sample_distance_classes", &sample_distance_classes, &flg);
+   PetscOptionsGetInt(PETSC_NULL,    NULL, "-sample_node_groups", &sample_node_groups,      &flg);
+   PetscOptionsGetReal(PETSC_NULL,   NULL, "-sample_exploration", &sample_exploration,      &flg);
    PetscOptionsGetString(PETSC_NULL, NULL, "-converge_at",      convergence, PATH_MAX, &flg);
+   PetscOptionsGetReal(PETSC_NULL,   NULL, "-converge_rse",    &converge_rse,               &flg);
+   PetscOptionsGetReal(PETSC_NULL,   NULL, "-rse_flow_fraction", &rse_flow_fraction,        &flg);
    PetscOptionsGetEList(PETSC_NULL,  NULL, "-output_format",
                                      output_formats, 3,  &output_format,              &flg); 
    DEPRICATED("output_format");
    PetscOptionsGetString(PETSC_NULL,  NULL, "-output_density_filename", output_density_filename, PATH_MAX, &flg);
    PetscOptionsGetString(PETSC_NULL,  NULL, "-output_sum_density_filename", output_sum_density_filename, PATH_MAX, &flg);
    PetscOptionsGetString(PETSC_NULL,  NULL, "-output_max_density_filename", output_max_density_filename, PATH_MAX, &flg);
+   PetscOptionsGetString(PETSC_NULL,  NULL, "-output_uncertainty_filename", output_uncertainty_filename, PATH_MAX, &flg);
+   PetscOptionsGetString(PETSC_NULL,  NULL, "-output_labels_filename", output_labels_filename, PATH_MAX, &flg);
+   PetscOptionsGetInt(PETSC_NULL,     NULL, "-threads",          &num_threads,                &flg);
+   PetscOptionsGetBool(PETSC_NULL,    NULL, "-keep_components",  &keep_components,            &flg);
+   PetscOptionsGetInt(PETSC_NULL,     NULL, "-component_groups", &component_groups,           &flg);
+   PetscOptionsGetInt(PETSC_NULL,     NULL, "-prefetch_pairs",   &prefetch_pairs,             &flg);
+   if(prefetch_pairs < 1)
+      prefetch_pairs = 1;
+   PetscOptionsGetBool(PETSC_NULL,    NULL, "-manager_solves",   &manager_solves,             &flg);
+   PetscOptionsGetString(PETSC_NULL,  NULL, "-perf_report",      perf_report_filename, PATH_MAX, &flg);
+   PetscOptionsGetInt(PETSC_NULL,     NULL, "-perf_report_interval", &perf_report_interval,   &flg);
+   PetscOptionsGetInt(PETSC_NULL,     NULL, "-tile_rows",        &tile_rows,                  &flg);
+   PetscOptionsGetInt(PETSC_NULL,     NULL, "-tile_cache",       &tile_cache,                 &flg);
+   PetscOptionsGetString(PETSC_NULL,  NULL, "-tile_directory",   tile_directory, PATH_MAX,    &flg);
 
    // User is using old format
    if(output_prefix[0]) {
@@ -141,6 +262,20 @@ static void parse_args()
       }
       message("Simulation will converge at %lg\n", converge_at);
    }
+   if(converge_rse > 0.) {
+      if(rse_flow_fraction < 0. || rse_flow_fraction > 1.) {
+         message("Error.  rse_flow_fraction must be between 0 and 1.\n");
+         MPI_Abort(MPI_COMM_WORLD, 1);
+      }
+      message("Simulation will converge when the relative standard error drops below %lg\n", converge_rse);
+   }
+   /* the default -shuffle_node_pairs of -1 shuffles too */
+   if((shuffle_node_pairs != 0 && !nearest_first && !furthest_first) || adaptive_sampling)
+      message("Random seed: %llu\n", (unsigned long long)random_seed);
+   if(adaptive_sampling && (sample_exploration <= 0. || sample_exploration > 1.)) {
+      message("Error.  sample_exploration must be in (0,1].\n");
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
    read_complete_solution();  /* TODO: Need to remove this feature */
 }
 
@@ -177,204 +312,520 @@ static void init_usr1_handler(int rank)
 static void init_node_pair_sequence(struct NodePairSequence *nps, struct PointPairs *pp)
 {
    PetscBool flg;
-   int i;
-   nps->count = (1<<20) /* pp->count */;
-   PetscMalloc(sizeof(int) * nps->count, &nps->seq);
-   PetscOptionsGetIntArray(PETSC_NULL, NULL, "-range", nps->seq, &nps->count, &flg);
+   PetscInt i, n;
+   n = 1<<20;
+   PetscMalloc(sizeof(PetscInt) * n, &nps->seq);
+   PetscOptionsGetIntArray(PETSC_NULL, NULL, "-range", nps->seq, &n, &flg);
    if(!flg) {
-      if(nps->count < pp->count) {
-         PetscFree(nps->seq);
-         nps->count = pp->count;
-         PetscMalloc(sizeof(int) * nps->count, &nps->seq);
-      }
-
+      PetscFree(nps->seq);
+      nps->seq = NULL;
       nps->count = pp->count;
-      for(i = 0; i < nps->count; i++)
-         nps->seq[i] = i;
    }
    else {
       i = 0;
-      while(i < nps->count) {
-         if(0 <= nps->seq[i] && nps->seq[i] < pp->count) {
+      while(i < n) {
+         if(0 <= nps->seq[i] && (size_t)nps->seq[i] < pp->count) {
             i++;
          }
          else {
-            message("Removing index %d from pair range.\n", nps->seq[i]);
-            nps->seq[i] = nps->seq[nps->count--];
+            message("Removing index %ld from pair range.\n", (long)nps->seq[i]);
+            nps->seq[i] = nps->seq[--n];
          }
       }
+      nps->count = n;
    }
 }
 
-static void init_communicator()
+static inline long sequence_at(struct NodePairSequence *nps, size_t i)
 {
-   int master[1] = { 0 };
-   MPI_Group world, workers;
-   MPI_Comm_group(MPI_COMM_WORLD, &world);
-   MPI_Group_excl(world, 1, master, &workers);
-   MPI_Comm_create(MPI_COMM_WORLD, workers, &COMM_WORKERS);
+   return nps->seq ? (long)nps->seq[i] : (long)i;
+}
+
+/* Every rank joins the communicator of the group it solves for; rank 0
+ * joins group 0 unless -manager_solves is off (`g` is -1) */
+static void init_communicator(int g)
+{
+   int rank;
+   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+   MPI_Comm_split(MPI_COMM_WORLD, g < 0 ? MPI_UNDEFINED : g, rank, &COMM_GROUP);
 }
 
 static void free_communicator()
 {
-   if(COMM_WORKERS != MPI_COMM_NULL)
-      MPI_Comm_free(&COMM_WORKERS);
+   if(COMM_GROUP != MPI_COMM_NULL)
+      MPI_Comm_free(&COMM_GROUP);
+   if(COMM_NODE != MPI_COMM_NULL)
+      MPI_Comm_free(&COMM_NODE);
+}
+
+/* With -node_shared the ranks on rank 0's node read the conductances
+ * from rank 0's copy, in a shared window, rather than being sent their
+ * rows.  Collective; returns whether this rank takes part. */
+static int share_conductance(struct ConductanceGrid *G)
+{
+   PetscBool node_shared = PETSC_FALSE, flg;
+   MPI_Comm node;
+   int rank, root;
+
+   PetscOptionsGetBool(PETSC_NULL, NULL, "-node_shared", &node_shared, &flg);
+   if(!node_shared)
+      return 0;
+   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+   MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+   root = rank;
+   MPI_Bcast(&root, 1, MPI_INT, 0, node);
+   if(root != 0) {
+      MPI_Comm_free(&node);
+      return 0;
+   }
+   COMM_NODE = node;
+   MPI_Bcast(&G->nrows, 1, MPI_SIZE_T, 0, COMM_NODE);
+   MPI_Bcast(&G->reach, 1, MPI_SIZE_T, 0, COMM_NODE);
+   return tile_share(&G->edges, COMM_NODE);
 }
 
-static void G_add_value(struct ConductanceGrid *G, int x, int y, double value)
+/* Set `member[r]` for the world ranks `r` in COMM_NODE */
+static void node_members(char *member)
 {
-   int j;
-   for(j = 0; G->cols[x*9+j] > -1 && G->cols[x*9+j] != y; j++) { }
-   assert(j < 9);
-   G->cols[x*9+j] = y;
-   G->values[x*9+j] += value;
+   MPI_Group node, world;
+   int i, n, *ranks, *world_ranks;
+
+   MPI_Comm_size(COMM_NODE, &n);
+   MPI_Comm_group(COMM_NODE, &node);
+   MPI_Comm_group(MPI_COMM_WORLD, &world);
+   PetscMalloc(sizeof(int) * n, &ranks);
+   PetscMalloc(sizeof(int) * n, &world_ranks);
+   for(i = 0; i < n; i++)
+      ranks[i] = i;
+   MPI_Group_translate_ranks(node, n, ranks, world, world_ranks);
+   for(i = 0; i < n; i++)
+      member[world_ranks[i]] = 1;
+   PetscFree(ranks);
+   PetscFree(world_ranks);
+   MPI_Group_free(&node);
+   MPI_Group_free(&world);
 }
 
-static void update_matrix(struct ResistanceGrid *R, struct ConductanceGrid *G,
-                   size_t i, size_t j, off_t a, off_t b)
+/* Split the components into `component_groups` contiguous runs of similar
+ * size and give each run a share of the workers in proportion to its
+ * cells.  Components are ordered largest first, so the mainland ends up
+ * with most of the ranks while the small islands are solved alongside it
+ * on one or two ranks each.  The solving ranks are [first,first+nworkers). */
+static int init_groups(struct ResistanceGrid *R, int first, int nworkers, struct WorkerGroup **groups)
 {
-   int id2 = R->cells[i+a][j+b].index;
-   if(id2 != -1) {
-      double val1 = R->cells[i][j].value;
-      double val2 = R->cells[i+a][j+b].value;
-      int id1 = R->cells[i][j].index;
-      double value = 2. / (val1 + val2);
-      if((a&b) != 0) /*a != 0 && b != 0)*/
-         value *= M_SQRT1_2;
-      if(isinf(value)) {
-         message("Infinite value found. R[%zu][%zu] = %lf; R[%llu][%llu] = %lf\n", i, j, val1, i+a, j+b, val2);
+   int    g, ngroups, assigned;
+   size_t c, remaining;
+
+   ngroups = MAX(1, MIN(component_groups, nworkers));
+   if(!keep_components || R->ncomponents < ngroups)
+      ngroups = keep_components ? MAX(1, (int)R->ncomponents) : 1;
+   PetscMalloc(sizeof(struct WorkerGroup) * ngroups, groups);
+
+   c = 0;
+   remaining = R->cell_count;
+   for(g = 0; g < ngroups; g++) {
+      struct WorkerGroup *wg = &(*groups)[g];
+      size_t target = remaining / (ngroups - g), load = 0;
+      size_t last = R->ncomponents > 0 ? R->ncomponents - (ngroups - g - 1) : 0;
+      wg->start = R->ncomponents > 0 ? R->components[c].start : 0;
+      while(c < last && (load < target || g == ngroups - 1)) {
+         load += R->components[c].count;
+         ++c;
       }
-      G_add_value(G, id1, id2, -value);
-      G_add_value(G, id2, id1, -value);
-      G_add_value(G, id1, id1,  value);
-      G_add_value(G, id2, id2,  value);
+      if(R->ncomponents == 0)
+         load = R->cell_count;
+      wg->end = wg->start + load;
+      remaining -= load;
+   }
+
+   assigned = 0;
+   for(g = 0; g < ngroups; g++) {
+      struct WorkerGroup *wg = &(*groups)[g];
+      double share = R->cell_count > 0 ? (double)(wg->end - wg->start) / R->cell_count : 0.;
+      wg->nranks = 1 + (long)((nworkers - ngroups) * share);
+      assigned += wg->nranks;
+   }
+   (*groups)[0].nranks += nworkers - assigned;
+   for(g = 0; g < ngroups; g++) {
+      struct WorkerGroup *wg = &(*groups)[g];
+      wg->first_rank = g == 0 ? first : (*groups)[g-1].first_rank + (*groups)[g-1].nranks;
+      if(ngroups > 1)
+         message("Group %d: rows %ld-%ld on %ld rank(s)\n", g, wg->start, wg->end, wg->nranks);
    }
+   return ngroups;
 }
 
-static PetscErrorCode init_conductance(struct ResistanceGrid *R, struct ConductanceGrid *G)
+/* First row of each of the group's components, counted from the
+ * group's first row, for the direct solver */
+static int group_components(struct Component *components, size_t ncomponents,
+                            struct WorkerGroup *wg, PetscInt **starts)
 {
-   int i, j;
-   PetscErrorCode ierr;
+   size_t c;
+   int n = 0;
 
-   message("Number of unknowns: %zu\n", R->cell_count);
+   PetscMalloc(sizeof(PetscInt) * MAX(ncomponents, 1), starts);
+   for(c = 0; c < ncomponents; c++) {
+      if(components[c].start >= (size_t)wg->start && components[c].start < (size_t)wg->end)
+         (*starts)[n++] = (PetscInt)(components[c].start - wg->start);
+   }
+   if(n == 0)
+      (*starts)[n++] = 0;
+   return n;
+}
 
-   G->nrows = R->cell_count;
-   ierr = PetscMalloc(sizeof(int) * G->nrows * 9, &G->cols); CHKERRQ(ierr);
-   ierr = PetscMalloc(sizeof(double) * G->nrows * 9, &G->values); CHKERRQ(ierr);
-   assert(G->cols != NULL);
-   assert(G->values != NULL);
+static int group_of(struct WorkerGroup *groups, int ngroups, size_t row)
+{
+   int g;
+   for(g = 0; g < ngroups; g++) {
+      if(row >= groups[g].start && row < groups[g].end)
+         return g;
+   }
+   return -1;
+}
 
-   for(i = 0; i < G->nrows; i++) {
-      for(j = 0; j < 9; j++) {
-         G->cols[i*9+j] = -1;
-         G->values[i*9+j] = 0.;
-      }
+/* Look up the nodes of pair `index` and the component they share.
+ * Returns the group that solves it, or -1 if it cannot be solved, which
+ * is reported when `report` is set. */
+static int classify_pair(struct ResistanceGrid *R, struct PointPairs *pp, long index,
+                         struct WorkerGroup *groups, int ngroups, int report,
+                         struct InFlight *f)
+{
+   struct Pair *p = &f->pair;
+   size_t c1, c2;
+
+   f->index = index;
+   f->pair = pair_at(pp, index);
+   f->nodes[0] = index_row(R, p->p1.x)[p->p1.y];
+   f->nodes[1] = index_row(R, p->p2.x)[p->p2.y];
+   if(f->nodes[0] == -1) {
+      if(report)
+         message("Node (%ld,%ld) has zero resistance (most likely).\n", p->p1.x, p->p1.y);
+      return -1;
+   }
+   if(f->nodes[1] == -1) {
+      if(report)
+         message("Node (%ld,%ld) has zero resistance (most likely).\n", p->p2.x, p->p2.y);
+      return -1;
+   }
+   c1 = component_of(R, f->nodes[0]);
+   c2 = component_of(R, f->nodes[1]);
+   if(c1 != c2) {
+      if(report)
+         write_disconnected_pair(p->p1.index, p->p2.index);
+      return -1;
    }
-   for(i = 0; i < R->nrows; i++) {
-      for(j = 0; j < R->ncols; j++) {
+   f->rows[0] = R->components[c1].start;
+   f->rows[1] = R->components[c1].start + R->components[c1].count;
+   return group_of(groups, ngroups, f->rows[0]);
+}
 
-         if(R->cells[i][j].index == -1)
-            continue;
+static struct PairQueue *init_queues(int ngroups)
+{
+   struct PairQueue *q;
 
-         if(likely(j < R->ncols-1)) 
-            update_matrix(R, G, i, j, 0, 1);      /* check east */
+   PetscMalloc(sizeof(struct PairQueue) * ngroups, &q);
+   memset(q, 0, sizeof(struct PairQueue) * ngroups);
+   return q;
+}
+
+static void queue_push(struct PairQueue *q, long index)
+{
+   if(q->head == q->count)
+      q->head = q->count = 0;
+   if(q->count == q->size) {
+      long *pairs;
+      q->size = MAX(2 * q->size, 64);
+      PetscMalloc(sizeof(long) * q->size, &pairs);
+      if(q->count > 0)
+         memcpy(pairs, q->pairs, sizeof(long) * q->count);
+      PetscFree(q->pairs);
+      q->pairs = pairs;
+   }
+   q->pairs[q->count++] = index;
+}
 
-         if(likely(i < R->nrows-1)) {
-            update_matrix(R, G, i, j, 1, 0);      /* check south */
+static size_t queued_pairs(struct PairQueue *queues, int ngroups)
+{
+   size_t n = 0;
+   int    g;
+   for(g = 0; g < ngroups; g++)
+      n += queues[g].count - queues[g].head;
+   return n;
+}
 
-            if(likely(j > 0))
-               update_matrix(R, G, i, j, 1, -1);  /* check south-west */
+static void free_queues(struct PairQueue *q, int ngroups)
+{
+   int g;
+   for(g = 0; g < ngroups; g++)
+      PetscFree(q[g].pairs);
+   PetscFree(q);
+}
 
-            if(likely(j < R->ncols-1))
-               update_matrix(R, G, i, j, 1, 1);   /* check south-east */
-         }
-      }
-   }
+/* Rows in the next message starting at global row `k`: within one of the
+ * manager's tiles and never more than MAX_MESSAGE_ROWS */
+static inline PetscInt message_rows(PetscInt k, PetscInt end)
+{
+   return MIN((PetscInt)tile_run(k, end, chunk_rows), MAX_MESSAGE_ROWS);
+}
 
-   return 0;
+/* Rows in the next message of matrix rows, which are expanded into a
+ * buffer before they are sent */
+static inline PetscInt transfer_rows(PetscInt k, PetscInt end)
+{
+   return MIN(message_rows(k, end), PACK_ROWS);
 }
 
-static void free_conductance(struct ConductanceGrid *G)
+/* Rows [range[0],range[1]) of a group's `count` that this rank holds,
+ * split as evenly as PETSc would.  Known before the matrix is set up,
+ * which happens as it is filled. */
+static void group_rows(PetscInt count, PetscInt range[2])
 {
-   PetscFree(G->cols);
-   PetscFree(G->values);
+   int grank, gsize;
+   PetscInt base, extra;
+
+   MPI_Comm_rank(COMM_GROUP, &grank);
+   MPI_Comm_size(COMM_GROUP, &gsize);
+   base  = count / gsize;
+   extra = count % gsize;
+   range[0] = grank * base + MIN(grank, extra);
+   range[1] = range[0] + base + (grank < extra);
 }
 
-static PetscErrorCode init_matrix(Mat *A, size_t count)
+static PetscErrorCode create_matrix(Mat *A, PetscInt count)
 {
-   int i, wsize;
    PetscInt range[2];
    PetscErrorCode ierr;
-   int nrows, *columns;
-   double *values;
 
-   MPI_Comm_size(COMM_WORKERS, &wsize);
-   ierr = MatCreate(COMM_WORKERS, A);  CHKERRQ(ierr);
-   ierr = MatSetSizes(*A, PETSC_DECIDE, PETSC_DECIDE, count, count);  CHKERRQ(ierr);
+   group_rows(count, range);
+   ierr = MatCreate(COMM_GROUP, A);  CHKERRQ(ierr);
+   ierr = MatSetSizes(*A, range[1] - range[0], range[1] - range[0], count, count);  CHKERRQ(ierr);
+   /* with -symmetric_storage only the diagonal and the neighbours
+    * numbered after it */
+   ierr = MatSetType(*A, symmetric_storage ? MATSBAIJ : MATAIJ);  CHKERRQ(ierr);
    ierr = MatSetFromOptions(*A);  CHKERRQ(ierr);
-   if(wsize == 1) {
-      /* incredibly slow if you use a parallel matrix with one process */
-      ierr = MatSeqAIJSetPreallocation(*A, 9, NULL); CHKERRQ(ierr); /* 8 neighbors and self */
-   }
-   else {
-      ierr = MatMPIAIJSetPreallocation(*A, 9, NULL, 9, NULL); CHKERRQ(ierr);
-   }
-   ierr = MatSetUp(*A);  CHKERRQ(ierr);
+   return 0;
+}
+
+/* Fill this rank's rows of `A`, either from the manager or, on the
+ * manager itself and the ranks sharing its memory, straight from `G`.
+ * `offset` is the first global row of the group's components. */
+static PetscErrorCode fill_matrix(Mat *A, PetscInt offset, struct ConductanceGrid *G)
+{
+   int j, rank, wsize, slots = symmetric_storage ? G_UPPER_SLOTS : 9;
+   PetscInt range[2], i, k, n, nrows, count, nnz, *ia, *ja;
+   struct GRowStream S;
+   PetscErrorCode ierr;
+   int *columns;
+   double *values;
 
-   MatGetOwnershipRange(*A, &range[0], &range[1]);
+   MatGetSize(*A, &count, NULL);
+   group_rows(count, range);
    nrows = range[1] - range[0];
    // message("range = %d - %d\n", range[0], range[1]);
 
-   ierr = PetscMalloc(sizeof(int) * nrows * 9, &columns);   CHKERRQ(ierr);
-   ierr = PetscMalloc(sizeof(double) * nrows * 9, &values); CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(int) * MAX(nrows, 1) * slots, &columns);   CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(double) * MAX(nrows, 1) * slots, &values); CHKERRQ(ierr);
 
-   MPI_Send(range, 2, MPI_INT, 0, TAG_ROW_RANGE, MPI_COMM_WORLD);
-   MPI_Recv(columns, nrows * 9, MPI_INT, 0, TAG_COL_VALUES, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-   MPI_Recv(values, nrows * 9, MPI_DOUBLE, 0, TAG_COL_VALUES, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+   range[0] += offset;
+   range[1] += offset;
+   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+   if(rank != 0) {
+      /* the manager collects the results by these ranges */
+      MPI_Send(range, 2, MPIU_INT, 0, TAG_ROW_RANGE, MPI_COMM_WORLD);
+      perf_sent(sizeof(range));
+   }
+   if(G)
+      G_stream_init(&S, G, range[0], symmetric_storage);
+   for(k = range[0]; k < range[1]; k += n) {
+      n = transfer_rows(k, range[1]);
+      if(G) {
+         G_stream_rows(&S, n, &columns[(k-range[0])*slots], &values[(k-range[0])*slots]);
+      }
+      else {
+         MPI_Recv(&columns[(k-range[0])*slots], (int)n * slots, MPI_INT, 0, TAG_COL_VALUES, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+         MPI_Recv(&values[(k-range[0])*slots], (int)n * slots, MPI_DOUBLE, 0, TAG_COL_VALUES, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+         perf_received((sizeof(int) + sizeof(double)) * n * slots);
+      }
+   }
+   if(G)
+      G_stream_free(&S);
+   range[0] -= offset;
+   range[1] -= offset;
    // message("Recieved!\n");
 
+   /* Compact the slots into CSR, which both preallocates exactly and
+    * fills in one go.  Column offsets are relative to the row, so the
+    * group's offset cancels; the slots are in column order. */
+   ierr = PetscMalloc(sizeof(PetscInt) * (nrows + 1), &ia);               CHKERRQ(ierr);
+   ierr = PetscMalloc(sizeof(PetscInt) * MAX(nrows, 1) * slots, &ja);     CHKERRQ(ierr);
+   nnz = 0;
+   ia[0] = 0;
    for(i = range[0]; i < range[1]; i++) {
-      MatSetValues(*A, 1, &i, 9, &columns[(i-range[0])*9], &values[(i-range[0])*9], INSERT_VALUES);
+      const int *offsets = &columns[(i-range[0])*slots];
+      for(j = 0; j < slots; j++) {
+         if(offsets[j] == G_EMPTY)
+            continue;
+         ja[nnz] = i + offsets[j];
+         values[nnz] = values[(i-range[0])*slots + j];
+         ++nnz;
+      }
+      ia[i-range[0]+1] = nnz;
    }
    ierr = PetscFree(columns);  CHKERRQ(ierr);
+
+   MPI_Comm_size(COMM_GROUP, &wsize);
+   if(symmetric_storage && wsize == 1) {
+      ierr = MatSeqSBAIJSetPreallocationCSR(*A, 1, ia, ja, values);  CHKERRQ(ierr);
+   }
+   else if(symmetric_storage) {
+      ierr = MatMPISBAIJSetPreallocationCSR(*A, 1, ia, ja, values);  CHKERRQ(ierr);
+   }
+   else if(wsize == 1) {
+      ierr = MatSeqAIJSetPreallocationCSR(*A, ia, ja, values);  CHKERRQ(ierr);
+   }
+   else {
+      ierr = MatMPIAIJSetPreallocationCSR(*A, ia, ja, values);  CHKERRQ(ierr);
+   }
+   ierr = PetscFree(ia);       CHKERRQ(ierr);
+   ierr = PetscFree(ja);       CHKERRQ(ierr);
    ierr = PetscFree(values);   CHKERRQ(ierr);
    // message("Assembled!\n");
 
-   /* FLUSH required before we can zero out a value */
-   ierr = MatAssemblyBegin(*A, MAT_FLUSH_ASSEMBLY);  CHKERRQ(ierr);
-   ierr = MatAssemblyEnd(*A, MAT_FLUSH_ASSEMBLY);  CHKERRQ(ierr);
+   return 0;
+}
 
+/* `offset` is the first global row of the group's components */
+static void init_result_send(struct ResultSend *out, Mat *A, PetscInt offset)
+{
+   PetscInt row_start, row_end, k, n;
+
+   MatGetOwnershipRange(*A, &row_start, &row_end);
+   out->nrequests = 1;  /* for TAG_DONE */
+   for(k = row_start + offset; k < row_end + offset; k += n) {
+      n = message_rows(k, row_end + offset);
+      ++out->nrequests;
+   }
+   PetscMalloc(sizeof(double) * MAX(row_end - row_start, 1), &out->values);
+   PetscMalloc(sizeof(MPI_Request) * out->nrequests, &out->requests);
+   for(k = 0; k < out->nrequests; k++)
+      out->requests[k] = MPI_REQUEST_NULL;
+}
+
+static void free_result_send(struct ResultSend *out)
+{
+   MPI_Waitall(out->nrequests, out->requests, MPI_STATUSES_IGNORE);
+   PetscFree(out->values);
+   PetscFree(out->requests);
+}
+
+/* Send this rank's rows of the solution to pair `id`.  The first rank of
+ * the group also tells the manager the pair is done; the manager then
+ * collects the rows from every rank. */
+static void send_result(struct ResultSend *out, const PetscScalar *result, Mat *A,
+                        PetscInt offset, const double *stats, int grank)
+{
+   PetscInt row_start, row_end, k, n;
+   int q = 0;
+
+   MatGetOwnershipRange(*A, &row_start, &row_end);
+   MPI_Waitall(out->nrequests, out->requests, MPI_STATUSES_IGNORE);
+   memcpy(out->values, result, sizeof(double) * (row_end - row_start));
+   for(k = row_start + offset; k < row_end + offset; k += n) {
+      n = message_rows(k, row_end + offset);
+      MPI_Isend(&out->values[k - row_start - offset], (int)n, MPI_DOUBLE, 0, TAG_RESULT,
+                MPI_COMM_WORLD, &out->requests[q++]);
+      perf_sent(sizeof(double) * n);
+   }
+   memcpy(out->done, stats, sizeof(out->done));
+   if(grank == 0) {
+      MPI_Isend(out->done, SOLVE_NSTATS, MPI_DOUBLE, 0, TAG_DONE, MPI_COMM_WORLD, &out->requests[q]);
+      perf_sent(sizeof(out->done));
+   }
+}
+
+/* One attempt at the system with solver configuration `config`,
+ * recording how it went in `stats` */
+static PetscErrorCode run_ksp(Mat *A, Vec b, Vec x, int config, double *stats)
+{
+   KSP  ksp;
+   PC   pc;
+   PetscInt  iterations;
+   PetscReal residual;
+   KSPConvergedReason reason;
+   double    t;
+   int       refinements;
+   PetscErrorCode ierr;
+
+   perf_push(PERF_KSP_SETUP);
+   t = microtime();
+   ierr = KSPCreate(COMM_GROUP, &ksp);  CHKERRQ(ierr);
+   ierr = KSPSetOptionsPrefix(ksp, solver_prefix(config));  CHKERRQ(ierr);
+   ierr = KSPSetOperators(ksp, *A, *A);   CHKERRQ(ierr);
+   ierr = KSPGetPC(ksp, &pc);             CHKERRQ(ierr);
+   ierr = KSPSetFromOptions(ksp);         CHKERRQ(ierr);
+   solver_set_tolerance(ksp);
+   if(deflation_vectors > 0) {
+      ierr = deflation_setup(ksp, *A, solver_prefix(config));  CHKERRQ(ierr);
+   }
+   ierr = KSPSetUp(ksp);                  CHKERRQ(ierr);
+   stats[SOLVE_SETUP_TIME] = microtime() - t;
+   perf_pop();
+
+   perf_push(PERF_KSP_SOLVE);
+   t = microtime();
+   ierr = solver_solve(ksp, *A, b, x, &iterations, &refinements);  CHKERRQ(ierr);
+   stats[SOLVE_SOLVE_TIME] = microtime() - t;
+   perf_pop();
+   KSPGetResidualNorm(ksp, &residual);
+   KSPGetConvergedReason(ksp, &reason);
+   perf_solved((long)iterations);
+   stats[SOLVE_ITERATIONS] = (double)iterations;
+   stats[SOLVE_RESIDUAL] = residual;
+   stats[SOLVE_REASON] = reason;
+   stats[SOLVE_CONFIG] = config;
+   stats[SOLVE_REFINEMENTS] = refinements;
+   if(deflation_vectors > 0) {
+      stats[SOLVE_DEFLATED] = deflation_size();
+      ierr = deflation_update(reason > 0);  CHKERRQ(ierr);
+   }
+
+   // ierr = PCDestroy(&pc);   CHKERRQ(ierr);
+   ierr = KSPDestroy(&ksp);  CHKERRQ(ierr);
    return 0;
 }
 
-static PetscErrorCode solve(Mat *A, int count, int srcnode, int destnode)
+static PetscErrorCode solve(Mat *A, PetscInt count, PetscInt offset, PetscInt srcnode, PetscInt destnode,
+                            PetscInt id, int config, int grank, struct ResultSend *out)
 {
-   int          nrows;
    PetscInt     row_start, row_end;
    PetscScalar  save;
    PetscInt     rhs_indices[2] = { destnode, srcnode };
    PetscScalar  rhs_values[2]  = {      -1.,      1. };
    PetscScalar *result;
+   double       stats[SOLVE_NSTATS] = { 0 };
+   int          iterative;
 
    Vec  x, b;
-   KSP  ksp;
-   PC   pc;
    PetscErrorCode ierr;
 
    MatGetOwnershipRange(*A, &row_start, &row_end);
-   nrows = row_end - row_start;
-
-   ierr = MatAssemblyBegin(*A, MAT_FINAL_ASSEMBLY);  CHKERRQ(ierr);
-   ierr = MatAssemblyEnd(*A, MAT_FINAL_ASSEMBLY);    CHKERRQ(ierr);
-   if(destnode >= row_start && destnode < row_end) {
-      ierr = MatGetValue(*A, destnode, destnode, &save);             CHKERRQ(ierr);
-      ierr = MatSetValue(*A, destnode, destnode, 0, INSERT_VALUES);  CHKERRQ(ierr);
-    /*  message("Saved value %lf from (%d,%d)\n", save, destnode, destnode); */
+   /* the factor is grounded already */
+   iterative = !direct_ready();
+
+   perf_push(PERF_KSP_SETUP);
+   if(iterative) {
+      ierr = MatAssemblyBegin(*A, MAT_FINAL_ASSEMBLY);  CHKERRQ(ierr);
+      ierr = MatAssemblyEnd(*A, MAT_FINAL_ASSEMBLY);    CHKERRQ(ierr);
+      if(destnode >= row_start && destnode < row_end) {
+         ierr = MatGetValue(*A, destnode, destnode, &save);             CHKERRQ(ierr);
+         ierr = MatSetValue(*A, destnode, destnode, 0, INSERT_VALUES);  CHKERRQ(ierr);
+       /*  message("Saved value %lf from (%d,%d)\n", save, destnode, destnode); */
+      }
+      ierr = MatAssemblyBegin(*A, MAT_FINAL_ASSEMBLY);  CHKERRQ(ierr);
+      ierr = MatAssemblyEnd(*A, MAT_FINAL_ASSEMBLY);  CHKERRQ(ierr);
    }
-   ierr = MatAssemblyBegin(*A, MAT_FINAL_ASSEMBLY);  CHKERRQ(ierr);
-   ierr = MatAssemblyEnd(*A, MAT_FINAL_ASSEMBLY);  CHKERRQ(ierr);
 
-   ierr = VecCreate(COMM_WORKERS, &x);  CHKERRQ(ierr);
+   ierr = VecCreate(COMM_GROUP, &x);  CHKERRQ(ierr);
    ierr = VecSetSizes(x, PETSC_DECIDE, count);  CHKERRQ(ierr);
    ierr = VecSetFromOptions(x);  CHKERRQ(ierr);
 
@@ -383,25 +834,37 @@ static PetscErrorCode solve(Mat *A, int count, int srcnode, int destnode)
    ierr = VecSetValues(b, 2, rhs_indices, rhs_values, INSERT_VALUES);  CHKERRQ(ierr);
    ierr = VecAssemblyBegin(b);  CHKERRQ(ierr);
    ierr = VecAssemblyEnd(b);    CHKERRQ(ierr);
+   perf_pop();
 
-   ierr = KSPCreate(COMM_WORKERS, &ksp);  CHKERRQ(ierr);
-   ierr = KSPSetOperators(ksp, *A, *A);   CHKERRQ(ierr);
-   ierr = KSPGetPC(ksp, &pc);             CHKERRQ(ierr);
-   ierr = KSPSetFromOptions(ksp);         CHKERRQ(ierr);
-   ierr = KSPSetUp(ksp);                  CHKERRQ(ierr);
-
-   ierr = KSPSolve(ksp, b, x);            CHKERRQ(ierr);
+   if(!iterative) {
+      perf_push(PERF_KSP_SOLVE);
+      ierr = direct_solve(b, x, destnode, stats);  CHKERRQ(ierr);
+      perf_pop();
+      perf_solved(0);
+   }
+   else {
+      ierr = run_ksp(A, b, x, config, stats);  CHKERRQ(ierr);
+   }
+   /* A candidate that fails on a trial pair is not used again, but the
+    * pair still needs an answer: solve it again the usual way.  The
+    * report is on the candidate's attempt. */
+   if(iterative && stats[SOLVE_REASON] <= 0 && config != 0) {
+      double retry[SOLVE_NSTATS];
+      ierr = run_ksp(A, b, x, 0, retry);  CHKERRQ(ierr);
+      stats[SOLVE_RETRIED] = 1;
+   }
+   stats[SOLVE_ID] = (double)id;
 
+   perf_push(PERF_GATHER);
    VecGetArray(x, &result);  /* shallow copy */
-   MPI_Send(result, nrows, MPI_DOUBLE, 0, TAG_RESULT, MPI_COMM_WORLD);
+   send_result(out, result, A, offset, stats, grank);
    VecRestoreArray(x, &result);
+   perf_pop();
 
    ierr = VecDestroy(&x);    CHKERRQ(ierr);
    ierr = VecDestroy(&b);    CHKERRQ(ierr);
-   // ierr = PCDestroy(&pc);   CHKERRQ(ierr);
-   ierr = KSPDestroy(&ksp);  CHKERRQ(ierr);
 
-   if(destnode >= row_start && destnode < row_end) {
+   if(iterative && destnode >= row_start && destnode < row_end) {
       ierr = MatSetValue(*A, destnode, destnode, save, INSERT_VALUES);  CHKERRQ(ierr);
    }
 
@@ -431,137 +894,464 @@ static int killswitch()
    return 0;
 }
 
+/* Next pair for group `g`, -1 once the group has no more work, or -2
+ * if it must wait for the other groups to take some of the pairs queued
+ * for them.  A single group follows the pair sequence (or the adaptive
+ * sampler) directly; several share one place in it and route the pairs
+ * read to their groups' queues.  Pairs that cannot be solved are
+ * reported as they are read. */
+static long next_pair(struct ResistanceGrid *R, struct PointPairs *pp,
+                      struct NodePairSequence *nps, struct Sampler *sampler,
+                      struct PairQueue *queues, size_t *drawn,
+                      struct WorkerGroup *groups, int ngroups, int g,
+                      struct InFlight *f)
+{
+   f->weight = 1.;
+   f->stratum = 0;
+   if(queues) {
+      struct PairQueue *q = &queues[g];
+      size_t queued = queued_pairs(queues, ngroups);
+      size_t limit = (size_t)QUEUE_ROUNDS * prefetch_pairs * ngroups;
+      long index;
+      while(q->head == q->count && *drawn < nps->count) {
+         int h;
+         if(queued >= limit)
+            return -2;
+         index = sequence_at(nps, (*drawn)++);
+         h = classify_pair(R, pp, index, groups, ngroups, 1, f);
+         if(h != -1) {
+            queue_push(&queues[h], index);
+            ++queued;
+         }
+      }
+      if(q->head == q->count)
+         return -1;
+      index = q->pairs[q->head++];
+      classify_pair(R, pp, index, groups, ngroups, 0, f);
+      return index;
+   }
+   while(*drawn < nps->count) {
+      long index;
+      if(adaptive_sampling)
+         index = sampler_next(sampler, &f->stratum, &f->weight);
+      else
+         index = sequence_at(nps, *drawn);
+      ++(*drawn);
+      if(classify_pair(R, pp, index, groups, ngroups, 1, f) != -1)
+         return index;
+   }
+   return -1;
+}
+
 static void manager()
 {
-   int i, j, index;
-   int mpi_size;
+   int i, g, r;
+   int mpi_size, ngroups, slots;
    struct PointPairs *pp;
    struct ResistanceGrid R;
    struct ConductanceGrid G;
    struct NodePairSequence nps;
+   struct Sampler sampler;
    struct RowRange *ranges;
-   double *voltages;
-   double start_time;
-   int terminate[2] = { -1, -1 };
+   char *on_node;   /* ranks reading the conductances from rank 0's window */
+   int *pack_cols;                /* the rows being sent, in slots */
+   double *pack_values;
+   struct WorkerGroup *groups;
+   struct PairQueue *queues;
+   struct Pipeline *pipes;
+   MPI_Request *done_requests;
+   struct TileArray voltages;
+   struct ResultSend out;
+   Mat A;
+   PetscInt count0 = 0;
+   double start_time, last_check;
+   size_t drawn, done, started;
+   int stop;
+   PetscInt terminate[4] = { -1, -1, -1, -1 };
 
    MPI_Comm_size(PETSC_COMM_WORLD, &mpi_size);
 
    parse_args();
    assert(habitat_file != NULL);
    assert(node_file != NULL);
+   perf_push(PERF_PARSE);
    parse_habitat_file(&R, habitat_file);
-   discard_islands(&R);
+   perf_pop();
+   if(!keep_components) {
+      perf_push(PERF_ISLANDS);
+      discard_islands(&R);
+      perf_pop();
+   }
+   perf_push(PERF_PARSE);
    pp = init_point_pairs(&R);
+   perf_pop();
+   if(keep_components) {
+      size_t k, nnodes;
+      int *nodes = pair_nodes(pp, &nnodes);
+      PetscInt *focal;
+      perf_push(PERF_ISLANDS);
+      PetscMalloc(sizeof(PetscInt) * MAX(nnodes, 1), &focal);
+      for(k = 0; k < nnodes; k++) {
+         struct Point *p = &pp->points[nodes[k]];
+         focal[k] = index_row(&R, p->x)[p->y];
+      }
+      split_components(&R, focal, nnodes);
+      PetscFree(focal);
+      free(nodes);
+      perf_pop();
+   }
    init_node_pair_sequence(&nps, pp);
+   /* sampled pairs may repeat, so solving as many as there are does
+    * not make the sum exact */
+   sample_population = adaptive_sampling ? 0 : nps.count;
+   if(adaptive_sampling)
+      init_sampler(&sampler, pp);
+   perf_push(PERF_CONDUCTANCE);
    init_conductance(&R, &G);
+   perf_pop();
 
-   if(mpi_size == 1) {
-      message("I'm all alone .. bye!\n");
-      goto solo_cleanup;
+   if(mpi_size == 1 && !manager_solves) {
+      message("Only one process; rank 0 solves the pairs itself.\n");
+      manager_solves = PETSC_TRUE;
    }
+   if(manager_solves)
+      ngroups = init_groups(&R, 0, mpi_size, &groups);
+   else
+      ngroups = init_groups(&R, 1, mpi_size - 1, &groups);
+   if(ngroups > 1 && adaptive_sampling) {
+      message("Adaptive sampling needs a single worker group; using the pair sequence instead.\n");
+      free_sampler(&sampler);
+      adaptive_sampling = PETSC_FALSE;
+      sample_population = nps.count;
+   }
+   queues = ngroups > 1 ? init_queues(ngroups) : NULL;
 
    PetscMalloc(sizeof(struct RowRange) * mpi_size, &ranges);
+   tile_init(&voltages, sizeof(double), G.nrows, habitat_tile_len(&R));
+   chunk_rows = voltages.tile_len;
+   perf_push(PERF_DISTRIBUTE);
    MPI_Bcast(&R.cell_count, 1, MPI_SIZE_T, 0, MPI_COMM_WORLD);
+   MPI_Bcast(&chunk_rows, 1, MPI_SIZE_T, 0, MPI_COMM_WORLD);
+   MPI_Bcast(&ngroups, 1, MPI_INT, 0, MPI_COMM_WORLD);
+   MPI_Bcast(groups, 4 * ngroups, MPI_LONG, 0, MPI_COMM_WORLD);
+   if(direct_solves) {
+      MPI_Bcast(&R.ncomponents, 1, MPI_SIZE_T, 0, MPI_COMM_WORLD);
+      MPI_Bcast(R.components, 2 * (int)R.ncomponents, MPI_SIZE_T, 0, MPI_COMM_WORLD);
+   }
+   init_communicator(manager_solves ? 0 : -1);
+   slots = symmetric_storage ? G_UPPER_SLOTS : 9;
+   PetscMalloc(sizeof(int) * PACK_ROWS * slots, &pack_cols);
+   PetscMalloc(sizeof(double) * PACK_ROWS * slots, &pack_values);
+   PetscMalloc(mpi_size, &on_node);
+   memset(on_node, 0, mpi_size);
+   if(share_conductance(&G))
+      node_members(on_node);
+
+   /* Rank 0 creates its share of group 0's matrix along with the rest of
+    * the group, but fills it only once every other rank has its rows:
+    * the fill ends in a collective assembly */
+   if(manager_solves) {
+      PetscInt rows[2];
+      count0 = groups[0].end - groups[0].start;
+      create_matrix(&A, count0);
+      group_rows(count0, rows);
+      ranges[0].start = rows[0] + groups[0].start;
+      ranges[0].end = rows[1] + groups[0].start;
+   }
    for(i = 1; i < mpi_size; i++) {
-      int nrows;
-      MPI_Recv(&ranges[i], 2, MPI_INT, i, TAG_ROW_RANGE, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-      nrows = ranges[i].end - ranges[i].start;
-      MPI_Send(&G.cols[ranges[i].start*9], nrows * 9, MPI_INT, i, TAG_COL_VALUES, MPI_COMM_WORLD);
-      MPI_Send(&G.values[ranges[i].start*9], nrows * 9, MPI_DOUBLE, i, TAG_COL_VALUES, MPI_COMM_WORLD);
-   }
-
-   start_time = microtime();
-   voltages = NULL;
-   for(i = 0; i < nps.count; i++) {
-      double pcoeff = 0;
-      index = nps.seq[i];
-      int nodes[2]  = { R.cells[pp->pairs[index].p1.x][pp->pairs[index].p1.y].index
-                      , R.cells[pp->pairs[index].p2.x][pp->pairs[index].p2.y].index };
-      if(nodes[0] == -1) {
-         message("Node (%ld,%ld) has zero resistance (most likely).\n", pp->pairs[index].p1.x, pp->pairs[index].p1.y);
-         continue;
+      struct GRowStream S;
+      PetscInt k, n;
+      MPI_Recv(&ranges[i], 2, MPIU_INT, i, TAG_ROW_RANGE, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      perf_received(sizeof(PetscInt) * 2);
+      if(on_node[i])
+         continue;   /* it reads them from the window */
+      G_stream_init(&S, &G, ranges[i].start, symmetric_storage);
+      for(k = ranges[i].start; k < ranges[i].end; k += n) {
+         n = transfer_rows(k, ranges[i].end);
+         G_stream_rows(&S, n, pack_cols, pack_values);
+         MPI_Send(pack_cols, (int)n * slots, MPI_INT, i, TAG_COL_VALUES, MPI_COMM_WORLD);
+         MPI_Send(pack_values, (int)n * slots, MPI_DOUBLE, i, TAG_COL_VALUES, MPI_COMM_WORLD);
+         perf_sent((sizeof(int) + sizeof(double)) * n * slots);
+      }
+      G_stream_free(&S);
+   }
+   if(manager_solves) {
+      fill_matrix(&A, groups[0].start, &G);
+      init_result_send(&out, &A, groups[0].start);
+   }
+   perf_pop();
+   PetscFree(pack_cols);
+   PetscFree(pack_values);
+   if(manager_solves && direct_solves) {
+      PetscInt *starts;
+      int n = group_components(R.components, R.ncomponents, &groups[0], &starts);
+      perf_push(PERF_KSP_SETUP);
+      direct_factor(A, starts, n);
+      perf_pop();
+      PetscFree(starts);
+   }
+
+   PetscMalloc(sizeof(struct Pipeline) * ngroups, &pipes);
+   PetscMalloc(sizeof(MPI_Request) * ngroups, &done_requests);
+   for(g = 0; g < ngroups; g++) {
+      PetscMalloc(sizeof(struct InFlight) * prefetch_pairs, &pipes[g].slots);
+      pipes[g].head = pipes[g].count = 0;
+      pipes[g].more = 1;
+      pipes[g].solved = 0;
+      done_requests[g] = MPI_REQUEST_NULL;
+   }
+
+   /* Keep every group's queue full and take the results of whichever
+    * group finishes first.  Pairs already sent when the run is stopped
+    * are still solved and counted.  When rank 0 is part of group 0 it
+    * solves group 0's next pair between handling results; its share of
+    * the solution reaches it through the same messages as everyone
+    * else's, so it waits for one pair to be handled before solving the
+    * next. */
+   start_time = last_check = microtime();
+   drawn = done = started = 0;
+   stop = 0;
+   while(1) {
+      struct Pipeline *q;
+      struct InFlight *f;
+      struct Pair *p;
+      double pcoeff, contribution;
+      int flag;
+
+      for(g = 0; g < ngroups; g++) {
+         q = &pipes[g];
+         while(!stop && q->more && q->count < prefetch_pairs) {
+            f = &q->slots[(q->head + q->count) % prefetch_pairs];
+            long index = next_pair(&R, pp, &nps, &sampler, queues, &drawn, groups, ngroups, g, f);
+            if(index == -2)
+               break;  /* the other groups' queues are full */
+            if(index == -1) {
+               q->more = 0;
+               break;
+            }
+            p = &f->pair;
+            message("Solving pair %ld (%zu of %zu): %d[%ld,%ld] to %d[%ld,%ld]. %7.2lf Km apart\n",
+                    f->index, ++started, nps.count,
+                    p->p1.index+1, p->p1.x, p->p1.y,
+                    p->p2.index+1, p->p2.x, p->p2.y,
+                    dist(p->p1, p->p2) * R.cellsize * 1e-3);
+            /* inform the group of the source and destination nodes */
+            f->message[0] = f->nodes[0];
+            f->message[1] = f->nodes[1];
+            f->message[2] = (PetscInt)started;
+            f->message[3] = solver_next_config();
+            if(g == 0 && manager_solves)
+               f->request = MPI_REQUEST_NULL;
+            else {
+               MPI_Isend(f->message, 4, MPIU_INT, groups[g].first_rank, TAG_PAIR, MPI_COMM_WORLD, &f->request);
+               perf_sent(sizeof(f->message));
+            }
+            ++q->count;
+         }
+         if(q->count > 0 && done_requests[g] == MPI_REQUEST_NULL)
+            MPI_Irecv(q->done, SOLVE_NSTATS, MPI_DOUBLE, groups[g].first_rank, TAG_DONE, MPI_COMM_WORLD, &done_requests[g]);
       }
-      if(nodes[1] == -1) {
-         message("Node (%ld,%ld) has zero resistance (most likely).\n", pp->pairs[index].p2.x, pp->pairs[index].p2.y);
-         continue;
+      if(manager_solves && pipes[0].count > 0 && !pipes[0].solved) {
+         PetscInt nodes[4];
+         q = &pipes[0];
+         memcpy(nodes, q->slots[q->head].message, sizeof(nodes));
+         MPI_Bcast(nodes, 4, MPIU_INT, 0, COMM_GROUP);
+         solve(&A, count0, groups[0].start, nodes[0] - groups[0].start, nodes[1] - groups[0].start,
+               nodes[2], (int)nodes[3], 0, &out);
+         q->solved = 1;
       }
-      message("Solving pair %d (%d of %d): %d[%ld,%ld] to %d[%ld,%ld]. %7.2lf Km apart\n",
-              index, i+1, nps.count,
-              pp->pairs[index].p1.index+1, pp->pairs[index].p1.x, pp->pairs[index].p1.y,
-              pp->pairs[index].p2.index+1, pp->pairs[index].p2.x, pp->pairs[index].p2.y,
-              dist(pp->pairs[index].p1, pp->pairs[index].p2) * R.cellsize * 1e-3);
-
-      /* inform the worker nodes of the source and destination nodes */
-      MPI_Bcast(nodes, 2, MPI_INT, 0, MPI_COMM_WORLD);
-      if(voltages != NULL) {
-         /* if we have a previous result, save to file (all but first pass through loop) */
-         pcoeff = write_result(&R, &G,
-                               index-1,
-                               pp->pairs[index-1].p1.index+1,
-                               pp->pairs[index-1].p2.index+1,
-                               voltages);
+
+      /* wait for a group to finish, without missing the killswitch or
+       * a USR1 in the meantime */
+      perf_push(PERF_IDLE);
+      while(1) {
          if(write_next_total_solution) {
-            write_total_current(&R, &G, 1-index);
+            write_total_current(&R, &G, done);
             write_next_total_solution = PETSC_FALSE;
          }
+         if(!stop && microtime() - last_check > KILLSWITCH_INTERVAL) {
+            last_check = microtime();
+            if(killswitch()) {
+               message("Killswitch engaged.\n");
+               stop = 1;
+            }
+         }
+         MPI_Testany(ngroups, done_requests, &g, &flag, MPI_STATUS_IGNORE);
+         if(flag)
+            break;
+         usleep(POLL_INTERVAL);
       }
-      else {
-         /* we'll only enter this branch once */
-         PetscMalloc(sizeof(double) * G.nrows, &voltages);
-      }
-      /* wait for workers to solve the linear system, then accept their results */
-      for(j = 1; j < mpi_size; j++) {
-         int nrows = ranges[j].end - ranges[j].start;
-         MPI_Recv(&voltages[ranges[j].start], nrows, MPI_DOUBLE, j, TAG_RESULT, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      perf_pop();
+      if(g == MPI_UNDEFINED) {
+         /* nothing left in flight; pairs still queued go out on the
+          * next round */
+         if(!stop && queues && queued_pairs(queues, ngroups) > 0)
+            continue;
+         break;
       }
-      write_effective_resistance(voltages, pp->pairs[index].p1.index, nodes[0],
-                                           pp->pairs[index].p2.index, nodes[1]);
-      show_eta(start_time, i, nps.count);
 
+      q = &pipes[g];
+      f = &q->slots[q->head];
+      p = &f->pair;
+      perf_received(sizeof(q->done));
+      if((PetscInt)q->done[SOLVE_ID] != f->message[2]) {
+         message("Error; group %d returned pair id %ld, expected %ld\n", g, (long)q->done[SOLVE_ID], (long)f->message[2]);
+         MPI_Abort(MPI_COMM_WORLD, 1);
+      }
+      message("Pair %ld took %ld KSP iterations.\n", f->index, (long)q->done[SOLVE_ITERATIONS]);
+      perf_pair_solved((long)q->done[SOLVE_ITERATIONS]);
+      solver_observe(f->index, g, q->done);
+      MPI_Wait(&f->request, MPI_STATUS_IGNORE);
+      q->head = (q->head + 1) % prefetch_pairs;
+      --q->count;
+      q->solved = 0;
+      perf_push(PERF_GATHER);
+      for(r = groups[g].first_rank; r < groups[g].first_rank + groups[g].nranks; r++) {
+         PetscInt k, n;
+         for(k = ranges[r].start; k < ranges[r].end; k += n) {
+            n = message_rows(k, ranges[r].end);
+            MPI_Recv(tile_at(&voltages, k), (int)n, MPI_DOUBLE, r, TAG_RESULT, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            perf_received(sizeof(double) * n);
+         }
+      }
+      perf_pop();
+      perf_push(PERF_OUTPUT);
+      write_effective_resistance(&voltages, p->p1.index, f->nodes[0],
+                                            p->p2.index, f->nodes[1]);
+      perf_pop();
+      pcoeff = write_result(&R, &G,
+                            f->index,
+                            p->p1.index+1,
+                            p->p2.index+1,
+                            &voltages, f->rows[0], f->rows[1],
+                            f->weight, &contribution);
+      if(adaptive_sampling)
+         sampler_observe(&sampler, f->stratum, contribution);
+      show_eta(start_time, done++, nps.count);
+      perf_interim(done);
       if(pcoeff > converge_at) {
          message("%lf > %lf; converged.\n", pcoeff, converge_at);
-         break;
+         stop = 1;
       }
-      if(killswitch()) {
-         message("Killswitch engaged.\n");
-         break;
+      if(converge_rse > 0. && done > 1) {
+         double rse = relative_standard_error(G.nrows);
+         if(rse < converge_rse) {
+            message("%lf < %lf; converged.\n", rse, converge_rse);
+            stop = 1;
+         }
       }
    }
    /* send the termination singal to the wokers */
-   MPI_Bcast(terminate, 2, MPI_INT, 0, MPI_COMM_WORLD);
+   for(g = 0; g < ngroups; g++) {
+      if(g == 0 && manager_solves)
+         MPI_Bcast(terminate, 4, MPIU_INT, 0, COMM_GROUP);
+      else {
+         MPI_Send(terminate, 4, MPIU_INT, groups[g].first_rank, TAG_PAIR, MPI_COMM_WORLD);
+         perf_sent(sizeof(terminate));
+      }
+   }
    /* write the final result */
-   write_result(&R, &G, nps.seq[i], pp->pairs[nps.seq[i]].p1.index+1,
-                pp->pairs[nps.seq[i]].p2.index+1, voltages);
-   write_total_current(&R, &G, i);
-
+   write_total_current(&R, &G, done);
+   solver_finish();
+
+   if(queues)
+      free_queues(queues, ngroups);
+   for(g = 0; g < ngroups; g++)
+      PetscFree(pipes[g].slots);
+   PetscFree(pipes);
+   PetscFree(done_requests);
+   PetscFree(groups);
    PetscFree(ranges);
-   PetscFree(voltages);
-solo_cleanup:
+   PetscFree(on_node);
+   tile_free(&voltages);
+   if(manager_solves) {
+      free_result_send(&out);
+      deflation_free();
+      direct_free();
+      MatDestroy(&A);
+   }
+   if(adaptive_sampling)
+      free_sampler(&sampler);
    free_habitat(&R);
    free_conductance(&G);
-   free(pp->pairs);
-   free(pp);
-   PetscFree(nps.seq);
+   free_point_pairs(pp);
+   if(nps.seq)
+      PetscFree(nps.seq);
 }
 
 static void worker()
 {
    Mat A;
    size_t count;
-   int rank;
+   int rank, grank, g, ngroups;
+   struct WorkerGroup *groups;
+   struct Component *components = NULL;
+   size_t ncomponents = 0;
+   struct ConductanceGrid G;
+   int shared;
+   struct ResultSend out;
 
    MPI_Comm_rank(PETSC_COMM_WORLD, &rank);
+   perf_push(PERF_IDLE);  /* while rank 0 reads the inputs */
    MPI_Bcast(&count, 1, MPI_SIZE_T, 0, MPI_COMM_WORLD);
-   init_matrix(&A, count);
+   MPI_Bcast(&chunk_rows, 1, MPI_SIZE_T, 0, MPI_COMM_WORLD);
+   MPI_Bcast(&ngroups, 1, MPI_INT, 0, MPI_COMM_WORLD);
+   PetscMalloc(sizeof(struct WorkerGroup) * ngroups, &groups);
+   MPI_Bcast(groups, 4 * ngroups, MPI_LONG, 0, MPI_COMM_WORLD);
+   if(direct_solves) {
+      MPI_Bcast(&ncomponents, 1, MPI_SIZE_T, 0, MPI_COMM_WORLD);
+      PetscMalloc(sizeof(struct Component) * MAX(ncomponents, 1), &components);
+      MPI_Bcast(components, 2 * (int)ncomponents, MPI_SIZE_T, 0, MPI_COMM_WORLD);
+   }
+   perf_pop();
+   for(g = 0; g < ngroups - 1; g++) {
+      if(rank < groups[g].first_rank + groups[g].nranks)
+         break;
+   }
+   init_communicator(g);
+   MPI_Comm_rank(COMM_GROUP, &grank);
+   shared = share_conductance(&G);
+
+   count = groups[g].end - groups[g].start;
+   perf_push(PERF_DISTRIBUTE);
+   create_matrix(&A, count);
+   fill_matrix(&A, groups[g].start, shared ? &G : NULL);
+   init_result_send(&out, &A, groups[g].start);
+   perf_pop();
+   if(direct_solves) {
+      PetscInt *starts;
+      int n = group_components(components, ncomponents, &groups[g], &starts);
+      perf_push(PERF_KSP_SETUP);
+      direct_factor(A, starts, n);
+      perf_pop();
+      PetscFree(starts);
+      PetscFree(components);
+   }
 
    while(1) {
-      int nodes[2];
-      MPI_Bcast(nodes, 2, MPI_INT, 0, MPI_COMM_WORLD);
+      PetscInt nodes[4];
+      /* the first rank of the group hears from the manager and tells the
+       * rest; the next pair is usually already waiting.  When the manager
+       * is itself the group's first rank it only broadcasts. */
+      perf_push(PERF_IDLE);
+      if(grank == 0) {
+         MPI_Recv(nodes, 4, MPIU_INT, 0, TAG_PAIR, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+         perf_received(sizeof(nodes));
+      }
+      MPI_Bcast(nodes, 4, MPIU_INT, 0, COMM_GROUP);
+      perf_pop();
       if(nodes[0] == -1)
          break;
-      solve(&A, count, nodes[0], nodes[1]);
+      solve(&A, count, groups[g].start, nodes[0] - groups[g].start, nodes[1] - groups[g].start,
+            nodes[2], (int)nodes[3], grank, &out);
    }
+   free_result_send(&out);
+   deflation_free();
+   direct_free();
    MatDestroy(&A);
+   if(shared)
+      free_conductance(&G);
+   PetscFree(groups);
 }
 
 int main(int argc, char *argv[])
@@ -571,14 +1361,18 @@ int main(int argc, char *argv[])
    PetscInitialize(&argc, &argv, NULL, NULL);
    PetscOptionsInsertString(NULL, common_options);
    MPI_Comm_rank(PETSC_COMM_WORLD, &rank);
+   perf_init();
+   solver_init();
+   direct_init();
 
-   init_communicator();
    init_usr1_handler(rank);
    if(rank == 0)
       manager();
    else 
       worker();
 
+   perf_finish();
    free_communicator();
+   free_threads();
    PetscFinalize();
 }
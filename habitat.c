@@ -26,8 +26,12 @@
 #include <petsc.h>
 
 #include "habitat.h"
+#include "threads.h"
 #include "util.h"
 
+char      output_labels_filename[PATH_MAX] = { 0 };
+PetscBool keep_components = PETSC_FALSE;
+
 static char *get_file_handle(const char *filename, long *fsz)
 {
    int     fd;
@@ -51,13 +55,9 @@ static char *get_file_handle(const char *filename, long *fsz)
 
 static void allocate_cells(struct ResistanceGrid *R)
 {
-   int i;
-   struct RCell *data;
-   PetscMalloc(sizeof(struct RCell) * R->nrows * R->ncols, &data);
-   PetscMalloc(sizeof(struct RCell *) * R->nrows, &R->cells);
-   for(i = 0; i < R->nrows; i++) {
-      R->cells[i] = &data[i * R->ncols];
-   }
+   size_t n = (size_t)R->nrows * R->ncols;
+   tile_init(&R->values, sizeof(float), n, habitat_tile_len(R));
+   tile_init(&R->index, sizeof(PetscInt), n, habitat_tile_len(R));
 }
 
 static char *parse_header(struct ResistanceGrid *R, char *grid)
@@ -90,125 +90,531 @@ static char *parse_header(struct ResistanceGrid *R, char *grid)
    return grid;
 }
 
+/* Start of each raster row in the file when the rows are one per line,
+ * otherwise NULL */
+static char **find_rows(struct ResistanceGrid *R, char *p, char *end)
+{
+   char **rows;
+   int    i = 0;
+
+   PetscMalloc(sizeof(char *) * MAX(R->nrows, 1), &rows);
+   while(p < end) {
+      char *eol = memchr(p, '\n', end - p), *q;
+      if(eol == NULL)
+         eol = end;
+      for(q = p; q < eol && isspace(*q); q++) { }
+      if(q < eol) {
+         if(i == R->nrows)
+            break;
+         rows[i++] = p;
+      }
+      p = eol + 1;
+   }
+   if(i != R->nrows || p < end) {
+      PetscFree(rows);
+      return NULL;
+   }
+   return rows;
+}
+
+struct ParseRows
+{
+   struct ResistanceGrid *R;
+   char  **rows;
+   size_t *first;   /* valid cells in each row, then the index of the first */
+};
+
+static void parse_rows(size_t start, size_t end, int tid, void *arg)
+{
+   struct ParseRows *pr = (struct ParseRows *)arg;
+   size_t i;
+   int    j;
+
+   for(i = start; i < end; i++) {
+      float *values = values_row(pr->R, i);
+      char  *p = pr->rows[i], *q;
+      size_t count = 0;
+      for(j = 0; j < pr->R->ncols; j++) {
+         values[j] = (float)strtod(p, &q);
+         // if(values[j] != R->NODATA_value && values[j] != 0.) {
+         if(values[j] > 0)
+            ++count;
+         p = q;
+      }
+      pr->first[i] = count;
+   }
+}
+
+static void number_rows(size_t start, size_t end, int tid, void *arg)
+{
+   struct ParseRows *pr = (struct ParseRows *)arg;
+   size_t i;
+   int    j;
+
+   for(i = start; i < end; i++) {
+      const float *values = values_row(pr->R, i);
+      PetscInt    *index  = index_row(pr->R, i);
+      PetscInt     k = pr->first[i];
+      for(j = 0; j < pr->R->ncols; j++)
+         index[j] = values[j] > 0 ? k++ : -1;
+   }
+}
+
+/* Rows are parsed by the thread pool when each is on its own line and
+ * the grid is held in memory; cells are numbered once every row's count
+ * is known */
 void parse_habitat_file(struct ResistanceGrid *R, const char *habitat_file)
 {
    long   fsz;
    char  *habitat;
    char  *p, *q;
-   int    i, j;
+   int    i, j, parallel;
+   struct ParseRows pr;
 
    habitat = get_file_handle(habitat_file, &fsz);
+   madvise(habitat, fsz, MADV_SEQUENTIAL);  /* read once, front to back */
    p = parse_header(R, habitat);
    allocate_cells(R);
+   R->ncomponents = 0;
+   R->components = NULL;
 
-   R->cell_count = 0;
-   for(i = 0; i < R->nrows; i++) {
-      for(j = 0; j < R->ncols; j++) {
-         R->cells[i][j].value = strtod(p, &q);
-         // if(R->cells[i][j].value != R->NODATA_value && R->cells[i][j].value != 0.) {
-         if(R->cells[i][j].value > 0) {
-            R->cells[i][j].index = R->cell_count++;
-         }
-         else {
-            R->cells[i][j].index = -1;
+   pr.R = R;
+   PetscMalloc(sizeof(size_t) * (R->nrows + 1), &pr.first);
+   parallel = !tile_is_mapped(&R->values) && num_threads > 1;
+   pr.rows = parallel ? find_rows(R, p, habitat + fsz) : NULL;
+   if(pr.rows) {
+      parallel_for(R->nrows, parse_rows, &pr);
+      PetscFree(pr.rows);
+   }
+   else {
+      for(i = 0; i < R->nrows; i++) {
+         float *values = values_row(R, i);
+         pr.first[i] = 0;
+         for(j = 0; j < R->ncols; j++) {
+            values[j] = (float)strtod(p, &q);
+            if(values[j] > 0)
+               ++pr.first[i];
+            p = q;
          }
-         p = q;
       }
    }
    munmap(habitat, fsz);
+
+   R->cell_count = 0;
+   for(i = 0; i < R->nrows; i++) {
+      size_t count = pr.first[i];
+      pr.first[i] = R->cell_count;
+      R->cell_count += count;
+   }
+   if(R->cell_count > PETSC_MAX_INT) {
+      message("Error; %zu cells need PETSc configured with --with-64-bit-indices\n", R->cell_count);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
+   parallel_for_if(!tile_is_mapped(&R->index), R->nrows, number_rows, &pr);
+   PetscFree(pr.first);
+   if(tile_is_mapped(&R->values))
+      message("Habitat held in tiles of %d rows under %s\n", (int)tile_rows, tile_directory);
 }
 
 void free_habitat(struct ResistanceGrid *R)
 {
-   PetscFree(R->cells[0]);
-   PetscFree(R->cells);
+   tile_free(&R->values);
+   tile_free(&R->index);
+   PetscFree(R->components);
 }
 
-void discard_islands(struct ResistanceGrid *R)
+struct LabelBlocks
 {
-   int    i, j;
-   int **labels, *label_buffer;
-   typedef struct { int x,y; } ToDo_t;
-   ToDo_t *todo;
-   int current_label, current_area, top, largest_label, largest_area;
+   struct ResistanceGrid *R;
+   struct TileArray parent;  /* union-find parents, later the labels */
+   int     nblocks;
+   size_t *kept;     /* number of cells kept per block */
+   PetscInt largest;  /* label of the largest component */
+};
 
-   PetscMalloc(sizeof(int)    * R->nrows * R->ncols, &label_buffer);
-   PetscMalloc(sizeof(int *)  * R->nrows, &labels);
-   PetscMalloc(sizeof(ToDo_t) * R->nrows * R->ncols, &todo);  /* overkill. will never need to be this large, but no point in making a dynamic allocation scheme for this */
-   for(i = 0; i < R->nrows; i++) {
-      labels[i] = &label_buffer[i * R->ncols];
+static inline PetscInt *parent_of(struct LabelBlocks *lb, PetscInt k)
+{
+   return (PetscInt *)tile_at(&lb->parent, k);
+}
+
+/* Union-find over the valid cells, addressed by their index.  Roots are
+ * always the smallest index in their set, so a parent never follows its
+ * child in index order. */
+static inline PetscInt uf_find(struct LabelBlocks *lb, PetscInt x)
+{
+   PetscInt p;
+   while((p = *parent_of(lb, x)) != x) {
+      PetscInt gp = *parent_of(lb, p);
+      *parent_of(lb, x) = gp;  /* path halving */
+      x = gp;
    }
-   memset(label_buffer, 0, sizeof(int) * R->nrows * R->ncols); /* 0 is the "unseen" label */
+   return x;
+}
+
+static inline void uf_union(struct LabelBlocks *lb, PetscInt a, PetscInt b)
+{
+   a = uf_find(lb, a);
+   b = uf_find(lb, b);
+   if(a < b)
+      *parent_of(lb, b) = a;
+   else if(b < a)
+      *parent_of(lb, a) = b;
+}
 
-   current_label = 1;
-   largest_label = 0;
-   largest_area  = 0;
+/* Join cell `j` of `row` with its already-visited neighbours (W, and NW,
+ * N, NE from the row above unless `up` is NULL), the same 8-neighbour
+ * stencil used to build the conductance matrix */
+static inline void link_cell(struct LabelBlocks *lb, const PetscInt *row, const PetscInt *up, int j)
+{
+   PetscInt k = row[j];
+   if(j > 0 && row[j-1] != -1)
+      uf_union(lb, k, row[j-1]);
+   if(up) {
+      if(j > 0 && up[j-1] != -1)
+         uf_union(lb, k, up[j-1]);
+      if(up[j] != -1)
+         uf_union(lb, k, up[j]);
+      if(j < lb->R->ncols-1 && up[j+1] != -1)
+         uf_union(lb, k, up[j+1]);
+   }
+}
 
-   for(i = 0; i < R->nrows; i++) {
-      for(j = 0; j < R->ncols; j++) {
-         if(labels[i][j] != 0)
-            continue;
-         if(R->cells[i][j].value <= 0) {  /* NODATA */
-            labels[i][j] = -1;
-            continue;
+static inline int block_row(struct LabelBlocks *lb, int b)
+{
+   return (int)(((size_t)lb->R->nrows * b) / lb->nblocks);
+}
+
+/* A tiled array can only be walked by one thread at a time */
+static void run_blocks(struct LabelBlocks *lb, size_t n, parallel_func func)
+{
+   parallel_for_if(!tile_is_mapped(&lb->R->index) && !tile_is_mapped(&lb->parent), n, func, lb);
+}
+
+static void init_parents(size_t start, size_t end, int tid, void *arg)
+{
+   struct LabelBlocks *lb = (struct LabelBlocks *)arg;
+   size_t k;
+   for(k = start; k < end; k++)
+      *parent_of(lb, k) = k;
+}
+
+/* Label each block of rows independently.  Every union stays inside the
+ * block's contiguous range of indices, so blocks never touch each other. */
+static void label_blocks(size_t start, size_t end, int tid, void *arg)
+{
+   struct LabelBlocks *lb = (struct LabelBlocks *)arg;
+   struct ResistanceGrid *R = lb->R;
+   size_t b;
+   int i, j;
+
+   for(b = start; b < end; b++) {
+      int first = block_row(lb, b), last = block_row(lb, b+1);
+      for(i = first; i < last; i++) {
+         const PetscInt *row = index_row(R, i);
+         const PetscInt *up  = i > first ? index_row(R, i-1) : NULL;
+         for(j = 0; j < R->ncols; j++) {
+            if(row[j] != -1)
+               link_cell(lb, row, up, j);
          }
+      }
+   }
+}
 
-	 /* Starting a new contiguous landmass */
-         todo[0].x = i; todo[0].y = j; top = 1;
-         current_area = 0;
-         while(top > 0) {
-            ++current_area;
-            --top;
-            int a = todo[top].x, b = todo[top].y;
-            labels[a][b] = current_label;
-            /* How long can we get away without checking for diagonal neighbors? */
-            if(a > 1 && labels[a-1][b] == 0 && R->cells[a-1][b].value > 0) {
-               todo[top].x = a - 1;
-               todo[top].y = b;
-               ++top;
-            }
-            if(b > 1 && labels[a][b-1] == 0 && R->cells[a][b-1].value > 0) {
-               todo[top].x = a;
-               todo[top].y = b - 1;
-               ++top;
-            }
-            if(a < R->nrows-1 && labels[a+1][b] == 0 && R->cells[a+1][b].value > 0) {
-               todo[top].x = a + 1;
-               todo[top].y = b;
-               ++top;
+static void count_kept(size_t start, size_t end, int tid, void *arg)
+{
+   struct LabelBlocks *lb = (struct LabelBlocks *)arg;
+   size_t b;
+   int i, j;
+
+   for(b = start; b < end; b++) {
+      lb->kept[b] = 0;
+      for(i = block_row(lb, b); i < block_row(lb, b+1); i++) {
+         const PetscInt *row = index_row(lb->R, i);
+         for(j = 0; j < lb->R->ncols; j++) {
+            if(row[j] != -1 && *parent_of(lb, row[j]) == lb->largest)
+               ++lb->kept[b];
+         }
+      }
+   }
+}
+
+/* `kept` holds the first new index of each block on entry */
+static void renumber_blocks(size_t start, size_t end, int tid, void *arg)
+{
+   struct LabelBlocks *lb = (struct LabelBlocks *)arg;
+   struct ResistanceGrid *R = lb->R;
+   size_t b;
+   int i, j;
+
+   for(b = start; b < end; b++) {
+      PetscInt next = lb->kept[b];
+      for(i = block_row(lb, b); i < block_row(lb, b+1); i++) {
+         float    *values = values_row(R, i);
+         PetscInt *index  = index_row(R, i);
+         for(j = 0; j < R->ncols; j++) {
+            if(index[j] == -1)
+               continue;
+            if(*parent_of(lb, index[j]) == lb->largest) {
+               index[j] = next++;
             }
-            if(b < R->ncols-1 && labels[a][b+1] == 0 && R->cells[a][b+1].value > 0) {
-               todo[top].x = a;
-               todo[top].y = b + 1;
-               ++top;
+            else {
+               index[j] = -1;
+               values[j] = R->NODATA_value;
             }
          }
-         if(current_area > largest_area) {
-            largest_label = current_label;
-            largest_area  = current_area;
+      }
+   }
+}
+
+static int cmp_component_size(const void *a, const void *b)
+{
+   const struct Component *x = a, *y = b;
+   if(x->count != y->count)
+      return x->count > y->count ? -1 : 1;
+   return x->start < y->start ? -1 : 1;
+}
+
+static void write_labels(struct LabelBlocks *lb, const char *filename)
+{
+   struct ResistanceGrid *R = lb->R;
+   FILE *fout;
+   int   i, j;
+
+   fout = fopen(filename, "w");
+   if(fout == NULL) {
+      message("Error; could not open %s\n", filename);
+      return;
+   }
+   fprintf(fout, "ncols %d\n", R->ncols);
+   fprintf(fout, "nrows %d\n", R->nrows);
+   fprintf(fout, "xllcorner %lf\n", R->xllcorner);
+   fprintf(fout, "yllcorner %lf\n", R->yllcorner);
+   fprintf(fout, "cellsize %d\n", (int)R->cellsize);
+   fprintf(fout, "NODATA_value %d\n", (int)R->NODATA_value);
+   for(i = 0; i < R->nrows; i++) {
+      const PetscInt *row = index_row(R, i);
+      for(j = 0; j < R->ncols; j++) {
+         if(row[j] == -1)
+            fprintf(fout, "%d ", (int)R->NODATA_value);
+         else
+            fprintf(fout, "%ld ", (long)*parent_of(lb, row[j]) + 1);
+      }
+      fprintf(fout, "\n");
+   }
+   fclose(fout);
+   message("Component labels %s written.\n", filename);
+}
+
+/* Label the 8-connected components.  Blocks of rows are labelled in
+ * parallel with a union-find over the cell indices, then joined across
+ * the block borders.  On return `lb->parent` holds the dense component
+ * label of every cell index; the only extra memory is this one index per
+ * valid cell, itself tiled along with the habitat. */
+static void label_components(struct LabelBlocks *lb, size_t *ncomponents, size_t **component_sizes)
+{
+   struct ResistanceGrid *R = lb->R;
+   size_t *sizes, nalloc;
+   PetscInt k;
+   int b, j;
+
+   tile_init(&lb->parent, sizeof(PetscInt), R->cell_count, habitat_tile_len(R));
+
+   run_blocks(lb, R->cell_count, init_parents);
+   run_blocks(lb, lb->nblocks, label_blocks);
+
+   /* merge across the block borders */
+   for(b = 1; b < lb->nblocks; b++) {
+      int i = block_row(lb, b);
+      const PetscInt *row = index_row(R, i);
+      const PetscInt *up  = index_row(R, i-1);
+      for(j = 0; j < R->ncols; j++) {
+         if(row[j] != -1)
+            link_cell(lb, row, up, j);
+      }
+   }
+
+   /* Replace parents with dense component labels.  Parents precede their
+    * children, so by the time a cell is reached its parent already holds
+    * the label. */
+   nalloc = 64;
+   *ncomponents = 0;
+   PetscMalloc(sizeof(size_t) * nalloc, &sizes);
+   for(k = 0; k < R->cell_count; k++) {
+      PetscInt p = *parent_of(lb, k), label;
+      if(p == k) {
+         if(*ncomponents == nalloc) {
+            size_t *tmp;
+            PetscMalloc(sizeof(size_t) * nalloc * 2, &tmp);
+            memcpy(tmp, sizes, sizeof(size_t) * nalloc);
+            PetscFree(sizes);
+            sizes = tmp;
+            nalloc *= 2;
          }
-         ++current_label;
+         label = *ncomponents;
+         sizes[(*ncomponents)++] = 0;
       }
+      else
+         label = *parent_of(lb, p);
+      *parent_of(lb, k) = label;
+      ++sizes[label];
    }
 
+   if(output_labels_filename[0])
+      write_labels(lb, output_labels_filename);
+
+   *component_sizes = sizes;
+}
+
+static void init_label_blocks(struct LabelBlocks *lb, struct ResistanceGrid *R)
+{
+   lb->R = R;
+   if(tile_is_mapped(&R->index))
+      lb->nblocks = 1;
+   else
+      lb->nblocks = (int)MIN(MAX(num_threads, 1), R->nrows);
+   PetscMalloc(sizeof(size_t) * lb->nblocks, &lb->kept);
+}
+
+static void free_label_blocks(struct LabelBlocks *lb)
+{
+   tile_free(&lb->parent);
+   PetscFree(lb->kept);
+}
+
+static void set_single_component(struct ResistanceGrid *R)
+{
+   PetscFree(R->components);
+   PetscMalloc(sizeof(struct Component), &R->components);
+   R->ncomponents = 1;
+   R->components[0].start = 0;
+   R->components[0].count = R->cell_count;
+}
+
+/* Keep only the largest 8-connected landmass */
+void discard_islands(struct ResistanceGrid *R)
+{
+   struct LabelBlocks lb;
+   size_t *sizes, ncomponents, nremoved, next;
+   PetscInt k;
+   int b;
+
+   if(R->cell_count == 0)
+      return;
+
+   init_label_blocks(&lb, R);
+   label_components(&lb, &ncomponents, &sizes);
+   lb.largest = 0;
+   for(k = 1; k < ncomponents; k++) {
+      if(sizes[k] > sizes[lb.largest])
+         lb.largest = k;
+   }
+
+   /* renumber the surviving cells, each block starting after the previous */
+   run_blocks(&lb, lb.nblocks, count_kept);
+   for(next = 0, b = 0; b < lb.nblocks; b++) {
+      size_t n = lb.kept[b];
+      lb.kept[b] = next;
+      next += n;
+   }
+   run_blocks(&lb, lb.nblocks, renumber_blocks);
+
+   nremoved = R->cell_count - sizes[lb.largest];
+   R->cell_count = sizes[lb.largest];
+   set_single_component(R);
+   message("Removed %zu islands (%zu cells).\n", ncomponents - 1, nremoved);
+
+   PetscFree(sizes);
+   free_label_blocks(&lb);
+}
+
+/* Keep every component that holds at least one of the `nfocal` cell
+ * indices in `focal`, as its own system.  Components are ordered from
+ * largest to smallest and each one is numbered contiguously, so the
+ * conductance matrix becomes block diagonal. */
+void split_components(struct ResistanceGrid *R, const PetscInt *focal, size_t nfocal)
+{
+   struct LabelBlocks lb;
+   size_t *sizes, *order, *fill, k, c, ncomponents, nkept, nremoved;
+   int i, j;
+
+   if(R->cell_count == 0)
+      return;
+
+   init_label_blocks(&lb, R);
+   label_components(&lb, &ncomponents, &sizes);
+
+   /* `order` maps a label to its position among the kept components */
+   PetscMalloc(sizeof(size_t) * ncomponents, &order);
+   for(c = 0; c < ncomponents; c++)
+      order[c] = -1;
+   for(k = 0; k < nfocal; k++) {
+      if(focal[k] != -1)
+         order[*parent_of(&lb, focal[k])] = 0;
+   }
+
+   nkept = 0;
+   for(c = 0; c < ncomponents; c++) {
+      if(order[c] == 0)
+         ++nkept;
+   }
+   PetscFree(R->components);
+   PetscMalloc(sizeof(struct Component) * MAX(nkept, 1), &R->components);
+   PetscMalloc(sizeof(size_t) * MAX(nkept, 1), &fill);
+   R->ncomponents = 0;
+   for(c = 0; c < ncomponents; c++) {
+      if(order[c] == 0) {
+         R->components[R->ncomponents].count = sizes[c];
+         R->components[R->ncomponents].start = c;  /* label, for sorting */
+         ++R->ncomponents;
+      }
+   }
+   qsort(R->components, R->ncomponents, sizeof(struct Component), cmp_component_size);
    R->cell_count = 0;
-   int nremoved = 0;
+   for(c = 0; c < R->ncomponents; c++) {
+      order[R->components[c].start] = c;
+      R->components[c].start = R->cell_count;
+      R->cell_count += R->components[c].count;
+      fill[c] = 0;
+   }
+
+   nremoved = 0;
    for(i = 0; i < R->nrows; i++) {
+      float    *values = values_row(R, i);
+      PetscInt *index  = index_row(R, i);
       for(j = 0; j < R->ncols; j++) {
-         if(labels[i][j] == -1)
+         if(index[j] == -1)
             continue;
-         if(labels[i][j] != largest_label) {
-            R->cells[i][j].index = -1;
-            R->cells[i][j].value = R->NODATA_value;
+         c = order[*parent_of(&lb, index[j])];
+         if(c != -1) {
+            index[j] = R->components[c].start + fill[c]++;
+         }
+         else {
+            index[j] = -1;
+            values[j] = R->NODATA_value;
             ++nremoved;
          }
-         else
-            R->cells[i][j].index = R->cell_count++;
       }
    }
-   message("Removed %d islands (%d cells).\n", current_label-2, nremoved);
+   message("Kept %zu components with focal nodes (%zu cells, largest %zu); removed %zu (%zu cells).\n",
+           R->ncomponents, R->cell_count, R->ncomponents ? R->components[0].count : 0,
+           ncomponents - R->ncomponents, nremoved);
 
-   PetscFree(label_buffer);
-   PetscFree(labels);
+   PetscFree(fill);
+   PetscFree(order);
+   PetscFree(sizes);
+   free_label_blocks(&lb);
 }
 
+/* Component holding cell index `k` */
+size_t component_of(struct ResistanceGrid *R, size_t k)
+{
+   size_t lo = 0, hi = R->ncomponents;
+   while(hi - lo > 1) {
+      size_t mid = (lo + hi) / 2;
+      if(R->components[mid].start <= k)
+         lo = mid;
+      else
+         hi = mid;
+   }
+   return lo;
+}
@@ -18,23 +18,53 @@
 #ifndef HABITAT_H
 #define HABITAT_H
 
-struct RCell
+/* A connected piece of habitat, numbered contiguously */
+struct Component
 {
-   double value;
-   size_t index;
+   size_t start, count;
 };
 
+#include "tiles.h"
+
 struct ResistanceGrid
 {
    int    ncols, nrows;
    double xllcorner, yllcorner;
    double cellsize, NODATA_value;
    size_t cell_count;
-   struct RCell **cells;
+   struct TileArray values;  /* resistance of every cell, row-major */
+   struct TileArray index;   /* unknown number of every cell, -1 for NODATA */
+   size_t ncomponents;
+   struct Component *components;
 };
 
+/* raster position of row `i`, column `j` */
+#define CELL(R,i,j)  ((size_t)(i) * (R)->ncols + (j))
+
+/* Rows never straddle two tiles, so a row pointer covers the whole row */
+static inline float *values_row(struct ResistanceGrid *R, int i)
+{
+   return (float *)tile_at(&R->values, CELL(R, i, 0));
+}
+
+static inline PetscInt *index_row(struct ResistanceGrid *R, int i)
+{
+   return (PetscInt *)tile_at(&R->index, CELL(R, i, 0));
+}
+
+/* Elements per tile of the raster and of every per-cell array */
+static inline size_t habitat_tile_len(struct ResistanceGrid *R)
+{
+   return (size_t)MAX(tile_rows, 1) * R->ncols;
+}
+
+extern char      output_labels_filename[PATH_MAX];
+extern PetscBool keep_components;
+
 void parse_habitat_file(struct ResistanceGrid *R, const char *habitat_file);
 void free_habitat(struct ResistanceGrid *R);
 void discard_islands(struct ResistanceGrid *R);
+void split_components(struct ResistanceGrid *R, const PetscInt *focal, size_t nfocal);
+size_t component_of(struct ResistanceGrid *R, size_t k);
 
 #endif  /* HABITAT_H */
@@ -27,22 +27,30 @@
 #include "util.h"
 #include "nodelist.h"
 #include "habitat.h"
+#include "threads.h"
 
 char       node_file[PATH_MAX] = { 0 };
 char       node_pair_file[PATH_MAX] = { 0 };
 PetscBool  nearest_first = PETSC_FALSE;
 PetscBool  furthest_first = PETSC_FALSE;
 PetscInt  shuffle_node_pairs = -1;
+PetscBool  locality_order = PETSC_FALSE;
+PetscInt   shuffle_block = 0;   /* 0 picks LOCALITY_BLOCK with -locality_order, else 1 */
 PetscReal  max_distance = 40e6;  /* circumference of the earth (approx) */
 PetscBool  resistance_only = PETSC_FALSE;
+uint64_t   random_seed = 0;
 
 static struct Point *parse_node_list(char *filename, size_t *npoints);
 static int validate_points(struct Point *points, size_t npoints, struct ResistanceGrid *R);
-static struct PointPairs *generate_pairs(struct Point *points, size_t npoints, double max_pixel_distance);
-static struct PointPairs *parse_node_pair_file(struct Point *points, size_t npoints, double max_pixel_distance);
+static void parse_node_pair_file(struct PointPairs *pp, double max_pixel_distance);
 static void sort_pairs_close(struct PointPairs *pairs);
 static void sort_pairs_far(struct PointPairs *pairs);
 static void shuffle_pairs(struct PointPairs *pairs);
+static void order_points(struct Point *points, size_t npoints);
+static void order_listed_pairs(struct PointPairs *pp);
+
+/* Pairs kept together when a locality order is shuffled */
+#define LOCALITY_BLOCK 64
 
 struct PointPairs *init_point_pairs(struct ResistanceGrid *R)
 {
@@ -56,14 +64,24 @@ struct PointPairs *init_point_pairs(struct ResistanceGrid *R)
 //      MPI_Abort(MPI_COMM_WORLD, 1);
    }
 
+   if(locality_order && (nearest_first || furthest_first)) {
+      message("Pairs are sorted by distance; ignoring -locality_order.\n");
+      locality_order = PETSC_FALSE;
+   }
+
+   pp = (struct PointPairs *)calloc(1, sizeof(struct PointPairs));
+   pp->points = points;
+   pp->ncount = npoints;
    if(strlen(node_pair_file) == 0) {
-      pp = generate_pairs(points, npoints, max_distance / R->cellsize);
+      if(locality_order)
+         order_points(points, npoints);
+      generate_pairs(pp, max_distance / R->cellsize);
    }
    else {
-      pp = parse_node_pair_file(points, npoints, max_distance / R->cellsize);
+      parse_node_pair_file(pp, max_distance / R->cellsize);
+      if(locality_order)
+         order_listed_pairs(pp);
    }
-   pp->ncount = npoints;
-   free(points);
 
    if(nearest_first)
       sort_pairs_close(pp);
@@ -100,7 +118,7 @@ int validate_points(struct Point *points, size_t npoints, struct ResistanceGrid
                          i+1, points[i].x, points[i].y, points[i].y, R->ncols);
          result = 0;
       }
-      if(R->cells[points[i].x][points[i].y].index == -1) {
+      if(index_row(R, points[i].x)[points[i].y] == -1) {
          fprintf(stderr, "Point #%zu (%ld,%ld) is invalid.\n", i+1, points[i].x, points[i].y);
          result = 0;
       }
@@ -148,8 +166,9 @@ static struct Point *node_list_is_asc(char *filename, size_t *npoints)
    parse_habitat_file(&R, filename);
    points = (struct Point *)malloc(nmax * sizeof(struct Point));
    for(i = 0; i < R.nrows; i++) {
+      const PetscInt *row = index_row(&R, i);
       for(j = 0; j < R.ncols; j++) {
-         int k = R.cells[i][j].index;
+         PetscInt k = row[j];
          if(k > -1) {
             if(k >= nmax) {
                nmax *= 2;
@@ -193,64 +212,197 @@ double dist(struct Point p1, struct Point p2)
    return hypot(0. + p1.x - p2.x, 0. + p1.y - p2.y);
 }
 
-struct PointPairs *generate_pairs(struct Point *points, size_t npoints, double max_pixel_distance)
+static inline double dist2(struct Point p1, struct Point p2)
 {
-   struct PointPairs *pp = NULL;
-   // PetscMalloc(sizeof(struct PointPairs), &pp);
-   pp = (struct PointPairs *)malloc(sizeof(struct PointPairs));
+   double dx = p1.x - p2.x, dy = p1.y - p2.y;
+   return dx * dx + dy * dy;
+}
 
-   size_t i, j;
-   size_t nmax = 32, skip_count = 0;
+/* Grid of square buckets, at least `radius` wide, over the bounding box
+ * of the points.  Everything within `radius` of a point lies in its own
+ * bucket or one of the eight around it.  Points are listed bucket by
+ * bucket in ascending order. */
+struct PointIndex
+{
+   struct Point *points;
+   size_t  npoints;
+   long    minx, miny;
+   double  width;      /* of a bucket */
+   long    nx, ny;     /* buckets along each axis */
+   size_t *start;      /* first entry of each bucket in `entries` */
+   size_t *entries;
+};
+
+/* keeps the bucket arrays O(npoints) however small the radius */
+#define BUCKETS_PER_POINT 4
+
+static inline long bucket_x(struct PointIndex *I, long x)
+{
+   return (long)((x - I->minx) / I->width);
+}
 
-   message("Max distance: %7.2f pixels\n", max_pixel_distance);
-   pp->pairs = (struct Pair *)realloc(NULL, nmax * sizeof(struct Pair));
-   pp->count = 0;
+static inline long bucket_y(struct PointIndex *I, long y)
+{
+   return (long)((y - I->miny) / I->width);
+}
+
+static void init_point_index(struct PointIndex *I, struct Point *points, size_t npoints, double radius)
+{
+   long   maxx, maxy, b;
+   size_t i, nbuckets;
+
+   I->points = points;
+   I->npoints = npoints;
+   I->minx = maxx = npoints ? points[0].x : 0;
+   I->miny = maxy = npoints ? points[0].y : 0;
+   for(i = 1; i < npoints; i++) {
+      I->minx = MIN(I->minx, points[i].x);
+      I->miny = MIN(I->miny, points[i].y);
+      maxx = MAX(maxx, points[i].x);
+      maxy = MAX(maxy, points[i].y);
+   }
+   I->width = MAX(radius, 1.);
+   while(1) {
+      double nx = floor((maxx - I->minx) / I->width) + 1;
+      double ny = floor((maxy - I->miny) / I->width) + 1;
+      if(nx * ny <= MAX(BUCKETS_PER_POINT * npoints, 1)) {
+         I->nx = (long)nx;
+         I->ny = (long)ny;
+         break;
+      }
+      I->width *= 2;
+   }
+
+   /* counting sort of the points into their buckets */
+   nbuckets = I->nx * I->ny;
+   I->start = (size_t *)calloc(nbuckets + 1, sizeof(size_t));
+   I->entries = (size_t *)malloc(sizeof(size_t) * MAX(npoints, 1));
+   for(i = 0; i < npoints; i++)
+      ++I->start[bucket_x(I, points[i].x) * I->ny + bucket_y(I, points[i].y) + 1];
+   for(b = 0; b < nbuckets; b++)
+      I->start[b+1] += I->start[b];
    for(i = 0; i < npoints; i++) {
-      for(j = i+1; j < npoints; j++) {
-         if(dist(points[i], points[j]) <= max_pixel_distance) {
-            if(pp->count == nmax) {
-               nmax *= 2;
-               pp->pairs = (struct Pair *)realloc(pp->pairs, nmax * sizeof(struct Pair));
+      b = bucket_x(I, points[i].x) * I->ny + bucket_y(I, points[i].y);
+      I->entries[I->start[b]++] = i;
+   }
+   for(b = nbuckets; b > 0; b--)
+      I->start[b] = I->start[b-1];
+   I->start[0] = 0;
+}
+
+static void free_point_index(struct PointIndex *I)
+{
+   free(I->start);
+   free(I->entries);
+}
+
+static int cmp_size_t(const void *a, const void *b)
+{
+   size_t x = *(const size_t *)a, y = *(const size_t *)b;
+   return x < y ? -1 : (x > y);
+}
+
+/* Points other than `i` within `radius` of it; only those after `i`
+ * unless `all` is set.  Their indices are written to `found` in
+ * ascending order unless it is NULL; returns how many. */
+static size_t points_within(struct PointIndex *I, size_t i, double radius, int all, size_t *found)
+{
+   struct Point p = I->points[i];
+   double r2 = radius * radius;
+   long   bx = bucket_x(I, p.x), by = bucket_y(I, p.y), x, y;
+   size_t e, n = 0;
+
+   for(x = MAX(bx - 1, 0); x <= MIN(bx + 1, I->nx - 1); x++) {
+      for(y = MAX(by - 1, 0); y <= MIN(by + 1, I->ny - 1); y++) {
+         size_t b = x * I->ny + y;
+         for(e = I->start[b]; e < I->start[b+1]; e++) {
+            size_t j = I->entries[e];
+            if((j > i || (all && j != i)) && dist2(p, I->points[j]) <= r2) {
+               if(found)
+                  found[n] = j;
+               ++n;
             }
-            pp->pairs[pp->count].p1 = points[i];
-            pp->pairs[pp->count].p2 = points[j];
-            ++pp->count;
-         }
-         else {
-            ++skip_count;
          }
       }
-      if(resistance_only)
-        break;
    }
-   message("%zu pairs generated.  %zu skipped.\n", pp->count, skip_count);
-   return pp;
+   if(found)
+      qsort(found, n, sizeof(size_t), cmp_size_t);
+   return n;
 }
 
-struct PointPairs *parse_node_pair_file(struct Point *points, size_t npoints, double max_pixel_distance)
+static void count_partners(size_t start, size_t end, int tid, void *arg)
 {
-   FILE *f;
-   struct PointPairs *pp = NULL;
-   pp = (struct PointPairs *)malloc(sizeof(struct PointPairs));
+   struct PointPairs *pp = (struct PointPairs *)arg;
+   size_t i;
+   for(i = start; i < end; i++)
+      pp->offset[i+1] = points_within(pp->index, i, pp->radius, 0, NULL);
+}
+
+/* First pair of source `i` when every later node is its partner */
+static inline size_t triangle_start(size_t n, size_t i)
+{
+   return i * (2 * n - i - 1) / 2;
+}
+
+/* Pairs (i,j), i < j, numbered by i then j.  Without a distance limit
+ * pair r is found by inverting triangle_start().  Otherwise the spatial
+ * index counts the partners of each source, in parallel, and pair r is
+ * looked up among the partners of the source whose range holds it. */
+void generate_pairs(struct PointPairs *pp, double max_pixel_distance)
+{
+   size_t i, n = pp->ncount, considered;
+
+   message("Max distance: %7.2f pixels\n", max_pixel_distance);
+   pp->nsources = resistance_only ? MIN(n, 1) : n;
+   considered = pp->nsources > 0 ? triangle_start(n, pp->nsources) : 0;
+
+   pp->radius = max_pixel_distance;
+   pp->index = (struct PointIndex *)malloc(sizeof(struct PointIndex));
+   pp->offset = (size_t *)calloc(pp->nsources + 1, sizeof(size_t));
+   init_point_index(pp->index, pp->points, n, max_pixel_distance);
+   parallel_for(pp->nsources, count_partners, pp);
+   for(i = 0; i < pp->nsources; i++)
+      pp->offset[i+1] += pp->offset[i];
+   pp->count = pp->offset[pp->nsources];
+
+   if(pp->count == considered) {
+      free_point_index(pp->index);
+      free(pp->index);
+      free(pp->offset);
+      pp->index = NULL;
+      pp->offset = NULL;
+   }
+   else {
+      pp->partners = (size_t *)malloc(sizeof(size_t) * MAX(n, 1));
+      pp->source = -1;
+   }
+   message("%zu pairs generated.  %zu skipped.\n", pp->count, considered - pp->count);
+}
 
+static void parse_node_pair_file(struct PointPairs *pp, double max_pixel_distance)
+{
+   FILE *f;
+   struct Point *points = pp->points;
+   size_t npoints = pp->ncount;
    size_t i, j;
    size_t nmax = 32, skip_count = 0;
+   double r2 = max_pixel_distance * max_pixel_distance;
 
    message("Max distance: %7.2f pixels\n", max_pixel_distance);
-   pp->pairs = (struct Pair *)realloc(NULL, nmax * sizeof(struct Pair));
+   pp->listed = (int *)realloc(NULL, 2 * nmax * sizeof(int));
    pp->count = 0;
 
    f = fopen(node_pair_file, "r");
    fscanf(f, "%zu %zu", &i, &j);
    while(!feof(f)) {
       if(i <= npoints && j <= npoints) {
-         if(dist(points[i-1], points[j-1]) <= max_pixel_distance) {
+         if(dist2(points[i-1], points[j-1]) <= r2) {
             if(pp->count == nmax) {
                nmax *= 2;
-               pp->pairs = (struct Pair *)realloc(pp->pairs, nmax * sizeof(struct Pair));
+               pp->listed = (int *)realloc(pp->listed, 2 * nmax * sizeof(int));
             }
-            pp->pairs[pp->count].p1 = points[i-1];
-            pp->pairs[pp->count].p2 = points[j-1];
+            pp->listed[2*pp->count]   = i-1;
+            pp->listed[2*pp->count+1] = j-1;
             ++pp->count;
          }
          else {
@@ -269,45 +421,343 @@ struct PointPairs *parse_node_pair_file(struct Point *points, size_t npoints, do
    }
 
    message("%zu pairs generated.  %zu skipped.\n", pp->count, skip_count);
-   return pp;
+}
+
+/* Nodes of pair number `r`, before any sorting or shuffling */
+static void unrank_pair(struct PointPairs *pp, size_t r, size_t *i, size_t *j)
+{
+   size_t n = pp->ncount, lo, hi;
+
+   if(pp->listed) {
+      *i = pp->listed[2*r];
+      *j = pp->listed[2*r+1];
+   }
+   else if(pp->offset) {
+      /* the last source whose first pair is at or before r */
+      lo = 0;
+      hi = pp->nsources;
+      while(hi - lo > 1) {
+         size_t mid = lo + (hi - lo) / 2;
+         if(pp->offset[mid] <= r)
+            lo = mid;
+         else
+            hi = mid;
+      }
+      if(pp->source != lo) {
+         points_within(pp->index, lo, pp->radius, 0, pp->partners);
+         pp->source = lo;
+      }
+      *i = lo;
+      *j = pp->partners[r - pp->offset[lo]];
+   }
+   else {
+      double b = 2. * n - 1.;
+      lo = (size_t)((b - sqrt(MAX(b * b - 8. * r, 0.))) / 2.);
+      lo = MIN(lo, n - 2);
+      while(lo > 0 && triangle_start(n, lo) > r)
+         --lo;
+      while(lo + 2 < n && triangle_start(n, lo + 1) <= r)
+         ++lo;
+      *i = lo;
+      *j = lo + 1 + (r - triangle_start(n, lo));
+   }
+}
+
+/* Position `k` of a shuffle of whole blocks.  Every block but the last
+ * holds `block` pairs, so only the slot the last one lands in shifts the
+ * positions after it. */
+static size_t shuffled_pair(struct PointPairs *pp, size_t k)
+{
+   size_t b = pp->block, tail = pp->count % b, s = pp->tail_slot;
+   size_t slot, offset;
+
+   if(tail == 0 || k < s * b) {
+      slot = k / b;
+      offset = k % b;
+   }
+   else if(k < s * b + tail) {
+      slot = s;
+      offset = k - s * b;
+   }
+   else {
+      slot = s + 1 + (k - s * b - tail) / b;
+      offset = (k - s * b - tail) % b;
+   }
+   return permutation_at(pp->shuffle, slot) * b + offset;
+}
+
+struct Pair pair_at(struct PointPairs *pp, size_t k)
+{
+   struct Pair p;
+   size_t i, j;
+
+   if(pp->order)
+      k = pp->order[k];
+   else if(pp->shuffle)
+      k = shuffled_pair(pp, k);
+   unrank_pair(pp, k, &i, &j);
+   p.p1 = pp->points[i];
+   p.p2 = pp->points[j];
+   return p;
+}
+
+struct PairKey
+{
+   double d;   /* squared distance */
+   size_t r;
+};
+
+static void pair_distances(size_t start, size_t end, int tid, void *arg)
+{
+   struct PointPairs *pp = ((struct PointPairs **)arg)[0];
+   struct PairKey *keys = ((struct PairKey **)arg)[1];
+   size_t i, k, *partners = NULL;
+
+   if(pp->listed) {
+      for(k = start; k < end; k++) {
+         keys[k].d = dist2(pp->points[pp->listed[2*k]], pp->points[pp->listed[2*k+1]]);
+         keys[k].r = k;
+      }
+      return;
+   }
+   if(pp->offset)
+      partners = (size_t *)malloc(sizeof(size_t) * MAX(pp->ncount, 1));
+   for(i = start; i < end; i++) {
+      size_t first, n;
+      if(pp->offset) {
+         first = pp->offset[i];
+         n = points_within(pp->index, i, pp->radius, 0, partners);
+      }
+      else {
+         first = triangle_start(pp->ncount, i);
+         n = pp->ncount - i - 1;
+      }
+      for(k = 0; k < n; k++) {
+         size_t j = partners ? partners[k] : i + 1 + k;
+         keys[first+k].d = dist2(pp->points[i], pp->points[j]);
+         keys[first+k].r = first + k;
+      }
+   }
+   free(partners);
 }
 
 static int cmp_pair_close(const void *a, const void *b)
 {
-   const struct Pair *x = a, *y = b;
-   return dist(x->p1, x->p2) < dist(y->p1, y->p2) ? -1 : 1;
+   const struct PairKey *x = a, *y = b;
+   if(x->d != y->d)
+      return x->d < y->d ? -1 : 1;
+   return x->r < y->r ? -1 : (x->r > y->r);
 }
 
 static int cmp_pair_far(const void *a, const void *b)
 {
-   const struct Pair *x = a, *y = b;
-   return dist(x->p1, x->p2) > dist(y->p1, y->p2) ? -1 : 1;
+   const struct PairKey *x = a, *y = b;
+   if(x->d != y->d)
+      return x->d > y->d ? -1 : 1;
+   return x->r < y->r ? -1 : (x->r > y->r);
+}
+
+/* Distances are worked out once, in parallel, rather than inside the
+ * comparison.  Ties keep their generated order. */
+static void sort_pairs(struct PointPairs *pp, int (*cmp)(const void *, const void *))
+{
+   struct PairKey *keys;
+   void  *arg[2];
+   size_t k;
+
+   keys = (struct PairKey *)malloc(sizeof(struct PairKey) * MAX(pp->count, 1));
+   arg[0] = pp;
+   arg[1] = keys;
+   parallel_for(pp->listed ? pp->count : pp->nsources, pair_distances, arg);
+   qsort(keys, pp->count, sizeof(struct PairKey), cmp);
+   pp->order = (size_t *)malloc(sizeof(size_t) * MAX(pp->count, 1));
+   for(k = 0; k < pp->count; k++)
+      pp->order[k] = keys[k].r;
+   free(keys);
 }
 
 void sort_pairs_close(struct PointPairs *pp)
 {
-   qsort(pp->pairs, pp->count, sizeof(struct Pair), cmp_pair_close);
+   sort_pairs(pp, cmp_pair_close);
 }
 
 void sort_pairs_far(struct PointPairs *pp)
 {
-   qsort(pp->pairs, pp->count, sizeof(struct Pair), cmp_pair_far);
+   sort_pairs(pp, cmp_pair_far);
 }
 
-// http://stackoverflow.com/a/6127606/7536
+/* A random permutation of the pairs, reproducible through `-seed`.  The
+ * pairs are shuffled in blocks of -shuffle_block, so a locality order is
+ * kept within each block while any prefix of the sequence is still a
+ * random sample of blocks. */
 void shuffle_pairs(struct PointPairs *pp)
 {
-   size_t i;
-   if(pp->count > RAND_MAX) {
-      message("shuffle_pairs cannot handle more than %d pairs", RAND_MAX);
+   struct Rng rng;
+   size_t nblocks;
+
+   pp->block = shuffle_block > 0 ? shuffle_block : (locality_order ? LOCALITY_BLOCK : 1);
+   nblocks = (pp->count + pp->block - 1) / pp->block;
+   if(nblocks < 2)
       return;
+   rng_seed(&rng, random_seed);
+   pp->shuffle = (struct Permutation *)malloc(sizeof(struct Permutation));
+   permutation_init(pp->shuffle, nblocks, &rng);
+   pp->tail_slot = 0;
+   if(pp->count % pp->block) {
+      while(permutation_at(pp->shuffle, pp->tail_slot) != nblocks - 1)
+         ++pp->tail_slot;
    }
+}
+
+/* Z-order (Morton) code of a cell: cells with nearby codes are close */
+static uint64_t morton(long x, long y)
+{
+   uint64_t code = 0;
+   int b;
+   for(b = 0; b < 32; b++) {
+      code |= (uint64_t)((x >> b) & 1) << (2 * b + 1);
+      code |= (uint64_t)((y >> b) & 1) << (2 * b);
+   }
+   return code;
+}
 
-   srand(time(0));  /* TODO: Should the random seed be a user provided value? */
-   for (i = 0; i < pp->count - 1; i++) {
-      size_t j = i + rand() / (RAND_MAX / (pp->count - i) + 1);
-      struct Pair t = pp->pairs[j];
-      pp->pairs[j] = pp->pairs[i];
-      pp->pairs[i] = t;
+struct PointKey
+{
+   uint64_t code;
+   struct Point p;
+};
+
+static int cmp_point_key(const void *a, const void *b)
+{
+   const struct PointKey *x = a, *y = b;
+   if(x->code != y->code)
+      return x->code < y->code ? -1 : 1;
+   return x->p.index - y->p.index;
+}
+
+/* Number the nodes along a Z-order curve.  Pairs are generated source by
+ * source with their partners in node order, so a source's pairs stay
+ * together and its sinks follow one another across the grid: the
+ * manager's output tiles, and whatever a solver keeps for one source,
+ * stay in use from one pair to the next.  Node ids are unchanged. */
+static void order_points(struct Point *points, size_t npoints)
+{
+   struct PointKey *keys;
+   size_t i;
+
+   keys = (struct PointKey *)malloc(sizeof(struct PointKey) * MAX(npoints, 1));
+   for(i = 0; i < npoints; i++) {
+      keys[i].code = morton(points[i].x, points[i].y);
+      keys[i].p = points[i];
+   }
+   qsort(keys, npoints, sizeof(struct PointKey), cmp_point_key);
+   for(i = 0; i < npoints; i++)
+      points[i] = keys[i].p;
+   free(keys);
+}
+
+struct ListedKey
+{
+   uint64_t code[2];
+   int      node[2];
+};
+
+static int cmp_listed_key(const void *a, const void *b)
+{
+   const struct ListedKey *x = a, *y = b;
+   int k;
+   for(k = 0; k < 2; k++) {
+      if(x->code[k] != y->code[k])
+         return x->code[k] < y->code[k] ? -1 : 1;
+      if(x->node[k] != y->node[k])
+         return x->node[k] - y->node[k];
+   }
+   return 0;
+}
+
+/* Listed pairs grouped by their first node, in Z-order, and then by the
+ * Z-order of the second */
+static void order_listed_pairs(struct PointPairs *pp)
+{
+   struct ListedKey *keys;
+   size_t k;
+   int e;
+
+   keys = (struct ListedKey *)malloc(sizeof(struct ListedKey) * MAX(pp->count, 1));
+   for(k = 0; k < pp->count; k++) {
+      for(e = 0; e < 2; e++) {
+         struct Point *p = &pp->points[pp->listed[2*k+e]];
+         keys[k].code[e] = morton(p->x, p->y);
+         keys[k].node[e] = pp->listed[2*k+e];
+      }
+   }
+   qsort(keys, pp->count, sizeof(struct ListedKey), cmp_listed_key);
+   for(k = 0; k < pp->count; k++) {
+      pp->listed[2*k]   = keys[k].node[0];
+      pp->listed[2*k+1] = keys[k].node[1];
+   }
+   free(keys);
+}
+
+static void mark_paired(size_t start, size_t end, int tid, void *arg)
+{
+   struct PointPairs *pp = ((struct PointPairs **)arg)[0];
+   char *paired = ((char **)arg)[1];
+   size_t i;
+   for(i = start; i < end; i++)
+      paired[i] = points_within(pp->index, i, pp->radius, 1, NULL) > 0;
+}
+
+/* The nodes that appear in at least one pair, in ascending order */
+int *pair_nodes(struct PointPairs *pp, size_t *n)
+{
+   char  *paired;
+   int   *nodes;
+   size_t i, k;
+
+   paired = (char *)calloc(MAX(pp->ncount, 1), 1);
+   if(pp->listed) {
+      for(k = 0; k < 2 * pp->count; k++)
+         paired[pp->listed[k]] = 1;
+   }
+   else if(pp->offset && pp->nsources == pp->ncount) {
+      void *arg[2] = { pp, paired };
+      parallel_for(pp->ncount, mark_paired, arg);
+   }
+   else if(pp->offset) {
+      for(i = 0; i < pp->nsources; i++) {
+         size_t m = points_within(pp->index, i, pp->radius, 0, pp->partners);
+         paired[i] |= m > 0;
+         for(k = 0; k < m; k++)
+            paired[pp->partners[k]] = 1;
+      }
+      pp->source = -1;
+   }
+   else if(pp->count > 0) {
+      memset(paired, 1, pp->ncount);
+   }
+
+   nodes = (int *)malloc(sizeof(int) * MAX(pp->ncount, 1));
+   *n = 0;
+   for(i = 0; i < pp->ncount; i++) {
+      if(paired[i])
+         nodes[(*n)++] = i;
+   }
+   free(paired);
+   return nodes;
+}
+
+void free_point_pairs(struct PointPairs *pp)
+{
+   if(pp->index) {
+      free_point_index(pp->index);
+      free(pp->index);
    }
+   free(pp->offset);
+   free(pp->partners);
+   free(pp->listed);
+   free(pp->order);
+   free(pp->shuffle);
+   free(pp->points);
+   free(pp);
 }
@@ -19,14 +19,19 @@
 #define NODELIST_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include "habitat.h"
+#include "util.h"
 
 extern char       node_file[PATH_MAX];
 extern char       node_pair_file[PATH_MAX];
 extern PetscBool  nearest_first;
 extern PetscBool  furthest_first;
 extern PetscInt  shuffle_node_pairs;
+extern PetscBool  locality_order;
+extern PetscInt   shuffle_block;
 extern PetscReal  max_distance;
+extern uint64_t   random_seed;
 
 struct Point
 {
@@ -35,14 +40,42 @@ struct Point
 };
 
 struct Pair { struct Point p1, p2; };
+
+struct PointIndex;
+
+/* The pairs to solve, numbered 0..count-1.  Only the focal nodes are
+ * kept; pair k is worked out from k when it is asked for, so memory
+ * grows with the number of nodes rather than the number of pairs.  The
+ * exceptions are pairs listed in a -node_pairs file, pairs sorted by
+ * distance and -adaptive_sampling, which need one entry per pair (the
+ * sampler keeps 8 bytes per pair in its strata and 24 while it sets
+ * them up). */
 struct PointPairs
 {
-   struct Pair *pairs;
-   size_t count;
-   size_t ncount;
+   struct Point *points;
+   size_t  ncount;       /* number of focal nodes */
+   size_t  count;        /* number of pairs */
+   size_t  nsources;     /* nodes that pairs start from */
+   int    *listed;       /* node numbers, two per pair, from -node_pairs */
+   struct PointIndex *index;  /* set when `radius` rules out some pairs */
+   double  radius;       /* in pixels */
+   size_t *offset;       /* first pair of each source node, with `index` */
+   size_t *order;        /* pairs sorted by distance */
+   struct Permutation *shuffle;  /* of blocks of `block` pairs */
+   size_t  block;
+   size_t  tail_slot;    /* where the last, partial block is shuffled to */
+   size_t  source;       /* source whose partners are in `partners` */
+   size_t *partners;
 };
 
 struct PointPairs *init_point_pairs(struct ResistanceGrid *R);
+struct Pair pair_at(struct PointPairs *pp, size_t k);
+int *pair_nodes(struct PointPairs *pp, size_t *n);
+void free_point_pairs(struct PointPairs *pp);
+
+/* All pairs of pp->points no further apart than `max_pixel_distance`;
+ * called by init_point_pairs() and by bench/kernels.c */
+void generate_pairs(struct PointPairs *pp, double max_pixel_distance);
 double dist(struct Point p1, struct Point p2) __attribute__ ((pure));
 
 #endif /* NODELIST_H */
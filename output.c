@@ -27,32 +27,63 @@
 #include <petsc.h>
 
 #include "output.h"
+#include "perf.h"
+#include "threads.h"
 #include "util.h"
 
 char      output_density_filename[PATH_MAX]     = { 0 };
 char      output_sum_density_filename[PATH_MAX] = { 0 };
 char      output_max_density_filename[PATH_MAX] = { 0 };
+char      output_uncertainty_filename[PATH_MAX] = { 0 };
 char      reff_path[PATH_MAX] = "";
 double    output_threshold = 1e-9;
+double    rse_flow_fraction = 0.1;
+size_t    sample_population = 0;
 PetscBool use_mpiio = PETSC_FALSE;
 
-static float *total_current = NULL;
-static float *max_density   = NULL;
-static float *final_current = NULL;
+/* The relative standard error is meaningless with only a handful of samples */
+#define RSE_MIN_SAMPLES 10
 
-static void write_asc(struct ResistanceGrid *R,
-                      struct ConductanceGrid *G,
-                      const char *filename,
-                      float *current,
-                      PetscBool compress);
+/* gzwrite() takes an unsigned length */
+#define AMP_WRITE_CELLS (1 << 28)
 
-static void write_amp(struct ConductanceGrid *G,
-                      const char *filename,
-                      float *current);
+/* Cells per unit of work in the per-cell passes.  Sums are kept per
+ * block and added in block order, so they come out the same whatever
+ * the number of threads. */
+#define CELL_BLOCK (1 << 16)
+
+/* Cells formatted at a time when writing an ASCII grid */
+#define ASC_BATCH_CELLS (1 << 20)
+
+/* Longest "%f " of a float, rounded up */
+#define ASC_CELL_CHARS 50
+
+/* Per-cell results, tiled along with the habitat when it is */
+static PetscBool        have_totals = PETSC_FALSE;
+static struct TileArray pair_current;   /* current density of the last pair */
+static struct TileArray total_current;
+static struct TileArray max_density;
+static float *final_current = NULL;
 
-static float *calculate_current(struct ConductanceGrid *G, double *voltages);
+/* Running per-cell mean and sum of squared deviations of the current
+ * density (Welford's algorithm), used to estimate the uncertainty of
+ * the summation when only a sample of the pairs is solved */
+static struct TileArray mean_current;
+static struct TileArray m2_current;
+static unsigned long nsamples = 0;
 
-static double pearson_coefficient(size_t n, float *x, float *w);
+/* Sums for Pearson's correlation coefficient, gathered in one pass */
+struct Pearson
+{
+   double Sxy, Sx, Sy, Sx2, Sy2;
+   size_t n;
+};
+
+static void   uncertainty_map(struct TileArray *rse, size_t n);
+static double finite_population_correction();
+static inline void pearson_add(struct Pearson *p, double x, double y);
+static void   pearson_merge(struct Pearson *p, const struct Pearson *q);
+static double pearson_coefficient(struct Pearson *p);
 static double sum_sqr(size_t n, float *x, float *w);
 static double rsme(size_t n, float *x, float *w);
 static int    nines(double x);
@@ -116,115 +147,342 @@ static void format_filename( char *deststr, const char *fmt
    *w = '\0';
 }
 
+static void write_map(struct ResistanceGrid *R,
+                      struct ConductanceGrid *G,
+                      const char *filename,
+                      struct TileArray *current)
+{
+   perf_push(PERF_OUTPUT);
+   if(endswith(filename, ".asc"))
+      write_asc(R, G, filename, current, PETSC_FALSE);
+   else if(endswith(filename, ".asc.gz"))
+      write_asc(R, G, filename, current, PETSC_TRUE);
+   else if(endswith(filename, ".amp"))
+      write_amp(G, filename, current);
+   else
+      message("Unknown file format for %s\n", filename);
+   perf_pop();
+}
+
+struct AccumulateBlock
+{
+   struct Pearson convergence, correlation;
+   double l1;
+};
+
+struct Accumulate
+{
+   size_t n;
+   double weight;
+   struct AccumulateBlock *blocks;
+};
+
+static void accumulate_blocks(size_t start, size_t end, int tid, void *arg)
+{
+   struct Accumulate *acc = (struct Accumulate *)arg;
+   size_t b, i, k, n;
+
+   for(b = start; b < end; b++) {
+      struct AccumulateBlock *blk = &acc->blocks[b];
+      size_t last = MIN((b + 1) * CELL_BLOCK, acc->n);
+      memset(blk, 0, sizeof(struct AccumulateBlock));
+      for(k = b * CELL_BLOCK; k < last; k += n) {
+         float *current = tile_at(&pair_current, k);
+         float *total   = tile_at(&total_current, k);
+         float *maximum = tile_at(&max_density, k);
+         float *mean    = tile_at(&mean_current, k);
+         float *m2      = tile_at(&m2_current, k);
+         n = tile_run(k, last, pair_current.tile_len);
+         for(i = 0; i < n; i++) {
+            double prev = total[i];
+            double weighted = acc->weight * current[i];
+            double delta = weighted - mean[i];
+            total[i] = weighted + prev;
+            maximum[i] = MAX(current[i], maximum[i]);
+            blk->l1 += current[i];
+            mean[i] += delta / nsamples;
+            m2[i] += delta * (weighted - mean[i]);
+            pearson_add(&blk->convergence, total[i], prev);
+            if(final_current)
+               pearson_add(&blk->correlation, final_current[k+i], total[i]);
+         }
+      }
+   }
+}
+
 double write_result(struct ResistanceGrid *R,
                     struct ConductanceGrid *G,
                     unsigned long iter,
                     unsigned long src,
                     unsigned long dest,
-                    double *voltages)
-{
-   float *current, *prev_total;
-   double pcoeff;
-   int    i;
-
-   current = calculate_current(G, voltages);
-   if(current) {
-      if(output_density_filename[0]) {
-         char fn[PATH_MAX];
-         format_filename(fn, output_density_filename, iter, src, dest);
-         if(endswith(fn, ".asc"))
-            write_asc(R, G, fn, current, PETSC_FALSE);
-         else if(endswith(fn, ".asc.gz"))
-            write_asc(R, G, fn, current, PETSC_TRUE);
-         else if(endswith(fn, ".amp"))
-            write_amp(G, fn, current);
-         else
-            message("Unknown file format for %s\n", output_density_filename);
-      }
-      else {
-         message("Solution to iteration %lu discarded.\n", iter);
-      }
+                    struct TileArray *voltages,
+                    size_t row_start,
+                    size_t row_end,
+                    double weight,
+                    double *contribution)
+{
+   double pcoeff, correlation;
 
-      if(total_current == NULL) {
-         PetscMalloc(sizeof(float) * G->nrows, &total_current);
-         memset(total_current, 0, sizeof(float) * G->nrows);
-      }
-      if(max_density == NULL) {
-         PetscMalloc(sizeof(float) * G->nrows, &max_density);
-         memset(max_density, 0, sizeof(float) * G->nrows);
-      }
-      prev_total = total_current;
-      PetscMalloc(sizeof(float) * G->nrows, &total_current);
-      for(i = 0; i < G->nrows; i++) {
-         total_current[i] = current[i] + prev_total[i];
-         max_density[i] = MAX(current[i], max_density[i]);
-      }
-      pcoeff = pearson_coefficient(G->nrows, total_current, prev_total);
-      message("convergence-factor = %e (%d-N)\n", pcoeff, nines(pcoeff));
-      if(final_current) {
-         double p = pearson_coefficient(G->nrows, final_current, total_current);
-         message("correlation = %e\n", p);
-      }
-      PetscFree(current);
-      PetscFree(prev_total);
-      return pcoeff;
+   init_totals(R, G);
+   perf_push(PERF_CURRENT);
+   calculate_current(G, voltages, row_start, row_end);
+   perf_pop();
+   if(output_density_filename[0]) {
+      char fn[PATH_MAX];
+      format_filename(fn, output_density_filename, iter, src, dest);
+      write_map(R, G, fn, &pair_current);
+   }
+   else {
+      message("Solution to iteration %lu discarded.\n", iter);
    }
-   return 0;
+
+   perf_push(PERF_ACCUMULATE);
+   pcoeff = accumulate_current(G, weight, contribution, &correlation);
+   perf_pop();
+   message("convergence-factor = %e (%d-N)\n", pcoeff, nines(pcoeff));
+   if(final_current)
+      message("correlation = %e\n", correlation);
+   return pcoeff;
+}
+
+/* One pass over every per-cell array: the running total (correlated
+ * against its previous value), the maximum and the moments of the
+ * weighted current */
+double accumulate_current(struct ConductanceGrid *G, double weight,
+                          double *contribution, double *correlation)
+{
+   struct Pearson convergence = { 0 }, final = { 0 };
+   struct Accumulate acc;
+   double l1 = 0.;
+   size_t b, nblocks;
+
+   ++nsamples;
+   acc.n = G->nrows;
+   acc.weight = weight;
+   nblocks = (G->nrows + CELL_BLOCK - 1) / CELL_BLOCK;
+   PetscMalloc(sizeof(struct AccumulateBlock) * MAX(nblocks, 1), &acc.blocks);
+   parallel_for_if(!tile_is_mapped(&pair_current), nblocks, accumulate_blocks, &acc);
+   for(b = 0; b < nblocks; b++) {
+      l1 += acc.blocks[b].l1;
+      pearson_merge(&convergence, &acc.blocks[b].convergence);
+      pearson_merge(&final, &acc.blocks[b].correlation);
+   }
+   PetscFree(acc.blocks);
+   if(contribution)
+      *contribution = l1;
+   if(correlation)
+      *correlation = final_current ? pearson_coefficient(&final) : 0.;
+   return pearson_coefficient(&convergence);
 }
 
 void write_total_current(struct ResistanceGrid *R,
                          struct ConductanceGrid *G,
                          int iter)
 {
+   perf_push(PERF_OUTPUT);
+   init_totals(R, G);
    if(output_sum_density_filename[0]) {
       char fn[PATH_MAX];
       format_filename(fn, output_sum_density_filename, iter, 0, 0);
-      if(endswith(fn, ".asc"))
-         write_asc(R, G, fn, total_current, PETSC_FALSE);
-      else if(endswith(fn, ".asc.gz"))
-         write_asc(R, G, fn, total_current, PETSC_TRUE);
-      else if(endswith(fn, ".amp"))
-         write_amp(G, fn, total_current);
+      write_map(R, G, fn, &total_current);
    }
 
    if(output_max_density_filename[0]) {
       char fn[PATH_MAX];
       format_filename(fn, output_max_density_filename, iter, 0, 0);
-      if(endswith(fn, ".asc"))
-         write_asc(R, G, fn, max_density, PETSC_FALSE);
-      else if(endswith(fn, ".asc.gz"))
-         write_asc(R, G, fn, max_density, PETSC_TRUE);
-      else if(endswith(fn, ".amp"))
-         write_amp(G, fn, max_density);
+      write_map(R, G, fn, &max_density);
+   }
+
+   if(output_uncertainty_filename[0] && nsamples > 0) {
+      char fn[PATH_MAX];
+      struct TileArray rse;
+      tile_init(&rse, sizeof(float), G->nrows, habitat_tile_len(R));
+      uncertainty_map(&rse, G->nrows);
+      format_filename(fn, output_uncertainty_filename, iter, 0, 0);
+      write_map(R, G, fn, &rse);
+      tile_free(&rse);
    }
+   perf_pop();
 
    // PetscFree(total_current);
 }
 
+/* Estimated relative standard error of the summed current density,
+ * taken as the worst cell among the high-flow cells (those whose mean
+ * density is at least `rse_flow_fraction` of the largest mean). */
+double relative_standard_error(size_t n)
+{
+   double max_mean = 0., worst = 0., fpc;
+   size_t i, k, run, ncells = 0;
+
+   if(nsamples < RSE_MIN_SAMPLES)
+      return INFINITY;
+   fpc = finite_population_correction();
+
+   for(k = 0; k < n; k += run) {
+      float *mean = tile_at(&mean_current, k);
+      run = tile_run(k, n, mean_current.tile_len);
+      for(i = 0; i < run; i++)
+         max_mean = MAX(max_mean, mean[i]);
+   }
+   if(max_mean <= 0.)
+      return INFINITY;
+
+   for(k = 0; k < n; k += run) {
+      float *mean = tile_at(&mean_current, k);
+      float *m2   = tile_at(&m2_current, k);
+      run = tile_run(k, n, mean_current.tile_len);
+      for(i = 0; i < run; i++) {
+         if(mean[i] >= rse_flow_fraction * max_mean) {
+            double var = m2[i] / (nsamples - 1);
+            double rse = fpc * sqrt(var / nsamples) / mean[i];
+            worst = MAX(worst, rse);
+            ++ncells;
+         }
+      }
+   }
+   message("relative-standard-error = %e (%zu high-flow cells)\n", worst, ncells);
+   return worst;
+}
+
+/* Pairs of the plain order are sampled without replacement, so the
+ * error vanishes once every pair of the population (if known) has been
+ * solved; adaptive sampling draws with replacement and leaves it 0 */
+static double finite_population_correction()
+{
+   if(sample_population == 0)
+      return 1.;
+   if(nsamples >= sample_population)
+      return 0.;
+   return sqrt(1. - (double)nsamples / sample_population);
+}
+
+void init_totals(struct ResistanceGrid *R, struct ConductanceGrid *G)
+{
+   size_t len = habitat_tile_len(R);
+
+   if(have_totals)
+      return;
+   tile_init(&pair_current,  sizeof(float), G->nrows, len);
+   tile_init(&total_current, sizeof(float), G->nrows, len);
+   tile_init(&max_density,   sizeof(float), G->nrows, len);
+   tile_init(&mean_current,  sizeof(float), G->nrows, len);
+   tile_init(&m2_current,    sizeof(float), G->nrows, len);
+   have_totals = PETSC_TRUE;
+}
+
+void free_totals()
+{
+   if(!have_totals)
+      return;
+   tile_free(&pair_current);
+   tile_free(&total_current);
+   tile_free(&max_density);
+   tile_free(&mean_current);
+   tile_free(&m2_current);
+   have_totals = PETSC_FALSE;
+   nsamples = 0;
+}
+
+struct TileArray *pair_current_density()
+{
+   return &pair_current;
+}
+
+/* Per-cell relative standard error of the summation, zero where no
+ * current has been observed */
+static void uncertainty_map(struct TileArray *rse, size_t n)
+{
+   double fpc = finite_population_correction();
+   size_t i, k, run;
+
+   for(k = 0; k < n; k += run) {
+      float *mean = tile_at(&mean_current, k);
+      float *m2   = tile_at(&m2_current, k);
+      float *out  = tile_at(rse, k);
+      run = tile_run(k, n, mean_current.tile_len);
+      for(i = 0; i < run; i++) {
+         if(nsamples > 1 && mean[i] > 0.)
+            out[i] = (float)(fpc * sqrt(m2[i] / (nsamples - 1) / nsamples) / mean[i]);
+         else
+            out[i] = 0.;
+      }
+   }
+}
+
+/* Rows [first,first+n) of an ASCII grid, formatted into one buffer per
+ * thread; the buffers are written in thread order, which is row order */
+struct AscRows
+{
+   struct ResistanceGrid *R;
+   struct TileArray      *current;
+   int                    first;
+   char                 **text;
+   size_t                *length, *capacity;
+};
+
+static void format_rows(size_t start, size_t end, int tid, void *arg)
+{
+   struct AscRows *A = (struct AscRows *)arg;
+   size_t need = (end - start) * ((size_t)A->R->ncols * ASC_CELL_CHARS + 1) + 1;
+   char  *w;
+   size_t r;
+   int    gy;
+
+   if(A->capacity[tid] < need) {
+      free(A->text[tid]);
+      A->text[tid] = (char *)malloc(need);
+      A->capacity[tid] = need;
+   }
+   w = A->text[tid];
+   for(r = start; r < end; r++) {
+      const PetscInt *row = index_row(A->R, A->first + (int)r);
+      for(gy = 0; gy < A->R->ncols; gy++) {
+         if(row[gy] == -1)
+            w += sprintf(w, "-9999 ");
+         else
+            w += sprintf(w, "%f ", *(float *)tile_at(A->current, row[gy]));
+      }
+      *w++ = '\n';
+   }
+   A->length[tid] = w - A->text[tid];
+}
+
+static int fwrite_all(void *f, const void *buf, unsigned len)
+{
+   return (int)fwrite(buf, 1, len, (FILE *)f);
+}
+
 void write_asc(struct ResistanceGrid *R,
                struct ConductanceGrid *G,
                const char *filename,
-               float *current,
+               struct TileArray *current,
                PetscBool compress)
 {
    void   *fout;  /* will either be FILE or gzFile */
-   int     i, gx, gy;
+   struct AscRows A;
+   int     nbuf = (int)MAX(num_threads, 1);
+   int     batch, t;
 
    typedef void *(*file_open_func)(const char *, const char *);
    typedef int   (*file_printf_func)(void *, const char *, ...);
+   typedef int   (*file_write_func)(void *, const void *, unsigned);
    typedef int   (*file_close_func)(void *);
    file_open_func   file_open;
    file_printf_func file_printf;
+   file_write_func  file_write;
    file_close_func  file_close;
 
    if(compress) {
       file_open = (file_open_func)gzopen;
       file_printf = (file_printf_func)gzprintf;
+      file_write = (file_write_func)gzwrite;
       file_close = (file_close_func)gzclose;
    }
    else {
       file_open = (file_open_func)fopen;
       file_printf = (file_printf_func)fprintf;
+      file_write = fwrite_all;
       file_close = (file_close_func)fclose;
    }
 
@@ -236,103 +494,173 @@ void write_asc(struct ResistanceGrid *R,
    file_printf(fout, "cellsize %d\n", (int)R->cellsize);
    file_printf(fout, "NODATA_value %d\n", (int)R->NODATA_value);
 
-   gx = gy = 0;
-   for(i = 0; i < G->nrows; i++) {
-
-      while(R->cells[gx][gy].index == -1) {
-         file_printf(fout, "-9999 ");
-         if(++gy == R->ncols) {
-            file_printf(fout, "\n");
-            gy = 0;
-            ++gx;
-         }
-      }
-
-      file_printf(fout, "%f ", current[i]);
-      if(++gy == R->ncols) {
-         file_printf(fout, "\n");
-         gy = 0;
-         ++gx;
+   /* cells are numbered by component, so look each one up rather than
+    * assuming the numbering follows the raster.  Formatting dominates,
+    * so a batch of rows is formatted in parallel and then written. */
+   A.R = R;
+   A.current = current;
+   A.text = (char **)calloc(nbuf, sizeof(char *));
+   A.length = (size_t *)calloc(nbuf, sizeof(size_t));
+   A.capacity = (size_t *)calloc(nbuf, sizeof(size_t));
+   batch = MAX(1, MIN(R->nrows, ASC_BATCH_CELLS / MAX(R->ncols, 1)));
+   for(A.first = 0; A.first < R->nrows; A.first += batch) {
+      int n = MIN(batch, R->nrows - A.first);
+      memset(A.length, 0, sizeof(size_t) * nbuf);
+      parallel_for_if(!tile_is_mapped(&R->index) && !tile_is_mapped(current),
+                      n, format_rows, &A);
+      for(t = 0; t < nbuf; t++) {
+         if(A.length[t] > 0)
+            file_write(fout, A.text[t], (unsigned)A.length[t]);
       }
    }
-
-   for(; gx < R->nrows; gx++) {
-      for(; gy < R->ncols; gy++)
-         file_printf(fout, "-9999 ");
-      file_printf(fout, "\n");
-      gy = 0;
-   }
+   for(t = 0; t < nbuf; t++)
+      free(A.text[t]);
+   free(A.text);
+   free(A.length);
+   free(A.capacity);
    file_close(fout);
    message("Result %s written.\n", filename);
 }
 
 void write_amp(struct ConductanceGrid *G,
                const char *filename,
-               float *current)
+               struct TileArray *current)
 {
    gzFile *fout;
+   size_t  k, n;
+   int     count = (int)G->nrows;
 
+   if(G->nrows > INT_MAX) {
+      message("Error; %s not written, the amp format holds at most %d cells.\n", filename, INT_MAX);
+      return;
+   }
    fout = gzopen(filename, "w");
-   gzwrite(fout, &G->nrows, sizeof(int));
-   gzwrite(fout, current, sizeof(float) * G->nrows);
+   gzwrite(fout, &count, sizeof(int));
+   for(k = 0; k < G->nrows; k += n) {
+      n = MIN(tile_run(k, G->nrows, current->tile_len), AMP_WRITE_CELLS);
+      gzwrite(fout, tile_at(current, k), sizeof(float) * n);
+   }
    gzclose(fout);
    message("Result %s written.\n", filename);
 }
 
-void write_effective_resistance(double *voltages, int srcindex,  int srcnode,
-                                                  int destindex, int destnode)
+void write_effective_resistance(struct TileArray *voltages, int srcindex,  PetscInt srcnode,
+                                                            int destindex, PetscInt destnode)
 {
    // V = IR;  I = 1A;  R = \delta{}V
-   message("R_eff = %d,%d,%lf\n", srcindex+1, destindex+1, voltages[srcnode] - voltages[destnode]);
+   double reff = *(double *)tile_at(voltages, srcnode);
+   reff -= *(double *)tile_at(voltages, destnode);
+   message("R_eff = %d,%d,%.*lf\n", srcindex+1, destindex+1, REFF_DECIMALS, reff);
    if(strlen(reff_path) > 0) {
       FILE *f = fopen(reff_path, "a");
-      fprintf(f, "%d,%d,%lf\n", srcindex+1, destindex+1, voltages[srcnode] - voltages[destnode]);
+      fprintf(f, "%d,%d,%.*lf\n", srcindex+1, destindex+1, REFF_DECIMALS, reff);
       fclose(f);
    }
 }
 
-float *calculate_current(struct ConductanceGrid *G, double *voltages)
+/* The two nodes lie in different components; no current can flow */
+void write_disconnected_pair(int srcindex, int destindex)
 {
-   int     i, j;
-   float  *current;
+   message("R_eff = %d,%d,inf\n", srcindex+1, destindex+1);
+   if(strlen(reff_path) > 0) {
+      FILE *f = fopen(reff_path, "a");
+      fprintf(f, "%d,%d,inf\n", srcindex+1, destindex+1);
+      fclose(f);
+   }
+}
 
-   PetscMalloc(sizeof(float) * G->nrows, &current);
-   for(i = 0; i < G->nrows; i++) {
-      double pos = 0;
-      double neg = 0;
+struct CurrentPass
+{
+   struct ConductanceGrid *G;
+   struct TileArray       *voltages;
+   size_t                  row_start, row_end;
+};
 
-      for(j = 0; G->cols[i*9+j] != -1 && j < 9; j++) {
-         
-         if(G->values[i*9+j] < 0) {
-           double amps = -G->values[i*9+j] * (voltages[i] - voltages[G->cols[i*9+j]]);
-           if(amps < 0)
-              neg += -amps;
-           else
-              pos +=  amps;
+static void current_blocks(size_t start, size_t end, int tid, void *arg)
+{
+   struct CurrentPass *P = (struct CurrentPass *)arg;
+   struct ConductanceGrid *G = P->G;
+   struct GRowStream S;
+   int    *cols   = (int *)malloc(sizeof(int) * CELL_BLOCK * 9);
+   double *values = (double *)malloc(sizeof(double) * CELL_BLOCK * 9);
+   size_t  b, i, first, last;
+   int     j;
+
+   /* the solved rows of these blocks follow one another, so they are
+    * expanded from the grid's edges by one stream */
+   G_stream_init(&S, G, MAX(start * CELL_BLOCK, P->row_start), 0);
+   for(b = start; b < end; b++) {
+      first = MAX(b * CELL_BLOCK, P->row_start);
+      last  = MIN(MIN((b + 1) * CELL_BLOCK, G->nrows), P->row_end);
+      if(first < last)
+         G_stream_rows(&S, last - first, cols, values);
+      for(i = b * CELL_BLOCK; i < MIN((b + 1) * CELL_BLOCK, G->nrows); i++) {
+         const int    *c;
+         const double *g;
+         double pos = 0;
+         double neg = 0;
+         double v;
+
+         if(i < first || i >= last) {
+            *(float *)tile_at(&pair_current, i) = 0.;
+            continue;
+         }
+         c = &cols[(i - first) * 9];
+         g = &values[(i - first) * 9];
+         v = *(double *)tile_at(P->voltages, i);
+         for(j = 0; j < 9; j++) {
+            if(c[j] != G_EMPTY && g[j] < 0) {
+              double amps = -g[j] * (v - *(double *)tile_at(P->voltages, i + c[j]));
+              if(amps < 0)
+                 neg += -amps;
+              else
+                 pos +=  amps;
+            }
          }
+         *(float *)tile_at(&pair_current, i) = (float)(fmax(pos, neg) < output_threshold ? 0. : fmax(pos, neg));
       }
-      current[i] = (float)(fmax(pos, neg) < output_threshold ? 0. : fmax(pos, neg));
    }
-   return current;
+   G_stream_free(&S);
+   free(cols);
+   free(values);
 }
 
-double pearson_coefficient(size_t n, float *x, float *y)
+/* Only rows [row_start,row_end) hold voltages of the solved system; the
+ * rest of the grid carries no current */
+void calculate_current(struct ConductanceGrid *G, struct TileArray *voltages,
+                       size_t row_start, size_t row_end)
 {
-   double Sxy = 0.  /* sum of xi*yi */
-        , Sx  = 0.  /* sum of xi    */
-        , Sy  = 0.  /* sum of yi    */
-        , Sx2 = 0.  /* sum of xi^2  */
-        , Sy2 = 0.; /* sum of yi^2  */
-   size_t i;
+   struct CurrentPass P = { G, voltages, row_start, row_end };
+   int parallel = !tile_is_mapped(&pair_current) && !tile_is_mapped(voltages)
+               && !tile_is_mapped(&G->edges);
 
-   for(i = 0; i < n; i++) {
-      Sxy += x[i] * y[i];
-      Sx  += x[i];
-      Sy  += y[i];
-      Sx2 += x[i] * x[i];
-      Sy2 += y[i] * y[i];
-   }
-   return (Sy2 > 0) ? (n * Sxy - Sx*Sy) / (sqrt(n * Sx2 - Sx*Sx) * sqrt(n * Sy2 - Sy*Sy)) : 0.;
+   parallel_for_if(parallel, (G->nrows + CELL_BLOCK - 1) / CELL_BLOCK, current_blocks, &P);
+}
+
+static inline void pearson_add(struct Pearson *p, double x, double y)
+{
+   p->Sxy += x * y;
+   p->Sx  += x;
+   p->Sy  += y;
+   p->Sx2 += x * x;
+   p->Sy2 += y * y;
+   ++p->n;
+}
+
+static void pearson_merge(struct Pearson *p, const struct Pearson *q)
+{
+   p->Sxy += q->Sxy;
+   p->Sx  += q->Sx;
+   p->Sy  += q->Sy;
+   p->Sx2 += q->Sx2;
+   p->Sy2 += q->Sy2;
+   p->n   += q->n;
+}
+
+double pearson_coefficient(struct Pearson *p)
+{
+   size_t n = p->n;
+   return (p->Sy2 > 0) ? (n * p->Sxy - p->Sx*p->Sy) / (sqrt(n * p->Sx2 - p->Sx*p->Sx) * sqrt(n * p->Sy2 - p->Sy*p->Sy)) : 0.;
 }
 
 double sum_sqr(size_t n, float *x, float *y)
@@ -22,6 +22,9 @@
 #include "habitat.h"
 #include "nodelist.h"
 
+/* Decimal places of the effective resistances written */
+#define REFF_DECIMALS 6
+
 enum {
    OUTPUT_FORMAT_ASC,
    OUTPUT_FORMAT_ASC_GZ,
@@ -31,7 +34,10 @@ enum {
 extern char      output_density_filename[PATH_MAX];
 extern char      output_sum_density_filename[PATH_MAX];
 extern char      output_max_density_filename[PATH_MAX];
+extern char      output_uncertainty_filename[PATH_MAX];
 extern double    output_threshold;
+extern double    rse_flow_fraction;
+extern size_t    sample_population;
 extern char      reff_path[PATH_MAX];
 extern PetscBool use_mpiio;
 
@@ -40,14 +46,44 @@ double write_result(struct ResistanceGrid *R,
                     unsigned long iter,
                     unsigned long src,
                     unsigned long dest,
-                    double *voltages);
+                    struct TileArray *voltages,
+                    size_t row_start,
+                    size_t row_end,
+                    double weight,
+                    double *contribution);
 
 void write_total_current(struct ResistanceGrid *R,
                          struct ConductanceGrid *G,
                          int index);
 
-void write_effective_resistance(double *voltages, int srcindex,  int srcnode,
-                                                  int destindex, int destnode);
+double relative_standard_error(size_t n);
+
+void write_effective_resistance(struct TileArray *voltages, int srcindex,  PetscInt srcnode,
+                                                            int destindex, PetscInt destnode);
+
+void write_disconnected_pair(int srcindex, int destindex);
 
 void read_complete_solution();
+
+/* The per-cell passes behind write_result() and write_total_current(),
+ * for bench/kernels.c.  init_totals() sizes the per-cell arrays for `G`
+ * and free_totals() drops them along with the sample count. */
+void init_totals(struct ResistanceGrid *R, struct ConductanceGrid *G);
+void free_totals();
+struct TileArray *pair_current_density();   /* of the last pair */
+
+void calculate_current(struct ConductanceGrid *G, struct TileArray *voltages,
+                       size_t row_start, size_t row_end);
+
+/* Adds the last pair's current, times `weight`, to the totals.  Returns
+ * the correlation of the total with its previous value; `contribution`
+ * gets the pair's summed current and `correlation` its correlation with
+ * the -complete_solution map, both when not NULL. */
+double accumulate_current(struct ConductanceGrid *G, double weight,
+                          double *contribution, double *correlation);
+
+void write_asc(struct ResistanceGrid *R, struct ConductanceGrid *G, const char *filename,
+               struct TileArray *current, PetscBool compress);
+void write_amp(struct ConductanceGrid *G, const char *filename, struct TileArray *current);
+
 #endif  /* OUTPUT_H */
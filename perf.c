@@ -0,0 +1,362 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include <petsc.h>
+
+#include "perf.h"
+#include "util.h"
+
+char     perf_report_filename[PATH_MAX] = { 0 };
+PetscInt perf_report_interval = 0;
+char     perf_trace_filename[PATH_MAX] = { 0 };
+PetscInt perf_trace_events = 1 << 20;
+
+static const char *phase_names[PERF_NPHASES] = {
+   "other", "parse", "islands", "conductance", "distribute", "ksp_setup",
+   "ksp_solve", "gather", "current", "accumulate", "output", "idle",
+};
+
+/* All doubles so that every rank's counters gather as one array */
+struct PerfCounters
+{
+   double seconds[PERF_NPHASES];
+   double wall;
+   double solves, iterations;
+   double bytes_sent, messages_sent;   /* GFlow's own messages, not PETSc's */
+   double bytes_received, messages_received;
+   double peak_rss;                    /* bytes */
+};
+
+#define PERF_DEPTH 16
+
+static struct PerfCounters counters;
+static PetscLogStage stages[PERF_NPHASES];
+static int    stack[PERF_DEPTH];
+static int    depth = 0;
+static double begin_time[PERF_DEPTH];
+static double start_time, last_time;
+
+/* One phase on the timeline, or a send or a receive when `phase` is
+ * PERF_SEND or PERF_RECEIVE.  All doubles, like the counters, so a
+ * rank's events go to rank 0 as one array. */
+struct PerfEvent
+{
+   double begin, end;   /* seconds since the ranks last synchronised */
+   double phase;
+   double bytes;
+};
+
+#define PERF_SEND    PERF_NPHASES
+#define PERF_RECEIVE (PERF_NPHASES + 1)
+
+#define TAG_TRACE 1000
+
+static struct PerfEvent *events = NULL;
+static size_t nevents = 0, dropped = 0;
+static int    tracing = 0;
+
+/* Pairs as seen by rank 0 */
+static struct
+{
+   long   count;
+   double iterations;
+   long   min, max;
+} pairs = { 0, 0., 0, 0 };
+
+static void record(int phase, double begin, double end, double bytes)
+{
+   if(nevents == (size_t)perf_trace_events) {
+      ++dropped;
+      return;
+   }
+   events[nevents].begin = begin - start_time;
+   events[nevents].end = end - start_time;
+   events[nevents].phase = phase;
+   events[nevents].bytes = bytes;
+   ++nevents;
+}
+
+static void charge()
+{
+   double now = microtime();
+   counters.seconds[depth > 0 ? stack[MIN(depth, PERF_DEPTH) - 1] : PERF_OTHER] += now - last_time;
+   last_time = now;
+}
+
+/* The trace options are read here rather than with the others, since
+ * every rank records its own events */
+void perf_init()
+{
+   PetscBool flg;
+   int p;
+
+   memset(&counters, 0, sizeof(counters));
+   for(p = 1; p < PERF_NPHASES; p++)
+      PetscLogStageRegister(phase_names[p], &stages[p]);
+   PetscOptionsGetString(PETSC_NULL, NULL, "-perf_trace",        perf_trace_filename, PATH_MAX, &flg);
+   PetscOptionsGetInt(PETSC_NULL,    NULL, "-perf_trace_events", &perf_trace_events,            &flg);
+   if(perf_trace_filename[0] && perf_trace_events > 0) {
+      events = (struct PerfEvent *)malloc(sizeof(struct PerfEvent) * perf_trace_events);
+      tracing = events != NULL;
+      /* line the ranks' clocks up, near enough for a timeline */
+      MPI_Barrier(MPI_COMM_WORLD);
+   }
+   start_time = last_time = microtime();
+   depth = 0;
+}
+
+void perf_push(int phase)
+{
+   charge();
+   if(depth < PERF_DEPTH) {
+      stack[depth] = phase;
+      begin_time[depth] = last_time;
+   }
+   ++depth;
+   PetscLogStagePush(stages[phase]);
+}
+
+void perf_pop()
+{
+   charge();
+   --depth;
+   if(tracing && depth < PERF_DEPTH)
+      record(stack[depth], begin_time[depth], last_time, 0.);
+   PetscLogStagePop();
+}
+
+void perf_sent(size_t bytes)
+{
+   counters.bytes_sent += bytes;
+   counters.messages_sent += 1;
+   if(tracing) {
+      double now = microtime();
+      record(PERF_SEND, now, now, (double)bytes);
+   }
+}
+
+void perf_received(size_t bytes)
+{
+   counters.bytes_received += bytes;
+   counters.messages_received += 1;
+   if(tracing) {
+      double now = microtime();
+      record(PERF_RECEIVE, now, now, (double)bytes);
+   }
+}
+
+void perf_solved(long iterations)
+{
+   counters.solves += 1;
+   counters.iterations += iterations;
+}
+
+void perf_pair_solved(long iterations)
+{
+   if(pairs.count == 0 || iterations < pairs.min)
+      pairs.min = iterations;
+   if(pairs.count == 0 || iterations > pairs.max)
+      pairs.max = iterations;
+   pairs.iterations += iterations;
+   ++pairs.count;
+}
+
+static void update_counters()
+{
+   struct rusage usage;
+   charge();
+   counters.wall = last_time - start_time;
+   if(getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+      counters.peak_rss = (double)usage.ru_maxrss;
+#else
+      counters.peak_rss = (double)usage.ru_maxrss * 1024.;
+#endif
+   }
+}
+
+static double fraction(double x, double total)
+{
+   return total > 0. ? x / total : 0.;
+}
+
+/* Write the report for `nranks` sets of counters.  It goes to a
+ * temporary file first so a reader never sees half of one. */
+static void write_report(const struct PerfCounters *all, int nranks, int final, size_t done)
+{
+   char tmp[PATH_MAX + 8];
+   double waiting = 0.;
+   FILE *f;
+   int r, p;
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", perf_report_filename);
+   f = fopen(tmp, "w");
+   if(f == NULL) {
+      message("Error; could not write the performance report to %s\n", tmp);
+      return;
+   }
+   for(r = 1; r < nranks; r++)
+      waiting += fraction(all[r].seconds[PERF_IDLE], all[r].wall);
+
+   fprintf(f, "{\n");
+   fprintf(f, "  \"final\": %s,\n", final ? "true" : "false");
+   fprintf(f, "  \"pairs_done\": %zu,\n", done);
+   fprintf(f, "  \"wall_seconds\": %.6f,\n", all[0].wall);
+   fprintf(f, "  \"pairs\": { \"solved\": %ld, \"ksp_iterations\": { \"total\": %.0f, \"min\": %ld, \"max\": %ld, \"mean\": %.3f } },\n",
+           pairs.count, pairs.iterations, pairs.min, pairs.max,
+           pairs.count > 0 ? pairs.iterations / pairs.count : 0.);
+   /* a manager that mostly waits is limited by the solver; workers that
+    * mostly wait are limited by the manager */
+   fprintf(f, "  \"manager_idle_fraction\": %.4f,\n", fraction(all[0].seconds[PERF_IDLE], all[0].wall));
+   if(nranks > 1)
+      fprintf(f, "  \"worker_idle_fraction\": %.4f,\n", waiting / (nranks - 1));
+   else
+      fprintf(f, "  \"worker_idle_fraction\": null,\n");
+   fprintf(f, "  \"ranks\": [\n");
+   for(r = 0; r < nranks; r++) {
+      const struct PerfCounters *c = &all[r];
+      fprintf(f, "    { \"rank\": %d, \"wall_seconds\": %.6f, \"phases\": {", r, c->wall);
+      for(p = 0; p < PERF_NPHASES; p++)
+         fprintf(f, "%s \"%s\": %.6f", p > 0 ? "," : "", phase_names[p], c->seconds[p]);
+      fprintf(f, " },\n      \"solves\": %.0f, \"ksp_iterations\": %.0f, \"bytes_sent\": %.0f, \"messages_sent\": %.0f,"
+                 " \"bytes_received\": %.0f, \"messages_received\": %.0f, \"peak_rss_bytes\": %.0f }%s\n",
+              c->solves, c->iterations, c->bytes_sent, c->messages_sent,
+              c->bytes_received, c->messages_received, c->peak_rss,
+              r < nranks - 1 ? "," : "");
+   }
+   fprintf(f, "  ]\n}\n");
+   fclose(f);
+   if(rename(tmp, perf_report_filename) != 0)
+      message("Error; could not move %s to %s\n", tmp, perf_report_filename);
+}
+
+void perf_interim(size_t done)
+{
+   if(!perf_report_filename[0] || perf_report_interval <= 0 || done % perf_report_interval != 0)
+      return;
+   update_counters();
+   write_report(&counters, 1, 0, done);
+}
+
+/* Chrome's trace event format, which Perfetto opens: one process per
+ * rank, a complete event per phase and an instant event per send or
+ * receive */
+static void write_events(FILE *f, const struct PerfEvent *e, int count, int rank)
+{
+   int i;
+
+   fprintf(f, "%s{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": 0, \"args\": {\"name\": \"rank %d\"}}",
+           rank > 0 ? ",\n" : "", rank, rank);
+   for(i = 0; i < count; i++, e++) {
+      if((int)e->phase == PERF_SEND || (int)e->phase == PERF_RECEIVE)
+         fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"pid\": %d, \"tid\": 0, \"ts\": %.1f, \"args\": {\"bytes\": %.0f}}",
+                 (int)e->phase == PERF_SEND ? "send" : "receive", rank, e->begin * 1e6, e->bytes);
+      else
+         fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": 0, \"ts\": %.1f, \"dur\": %.1f}",
+                 phase_names[(int)e->phase], rank, e->begin * 1e6, (e->end - e->begin) * 1e6);
+   }
+}
+
+/* Rank 0 writes its own events and then each other rank's in turn, so
+ * it never holds more than one rank's events and every message is at
+ * most -perf_trace_events events long.  Ranks send only when asked, so
+ * their events do not pile up at rank 0 either. */
+static void finish_trace(int rank, int size)
+{
+   MPI_Datatype event_type;
+   int count = (int)nevents, r;
+   double lost = (double)dropped, total_lost = 0.;
+
+   MPI_Type_contiguous((int)(sizeof(struct PerfEvent) / sizeof(double)), MPI_DOUBLE, &event_type);
+   MPI_Type_commit(&event_type);
+   MPI_Reduce(&lost, &total_lost, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+   if(rank == 0) {
+      FILE *f = fopen(perf_trace_filename, "w");
+      if(f == NULL)
+         message("Error; could not write the trace to %s\n", perf_trace_filename);
+      else
+         fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+      /* without a buffer of its own rank 0 asks the others for nothing */
+      int ready = events != NULL;
+      for(r = 0; r < size; r++) {
+         if(r > 0) {
+            MPI_Send(&ready, 1, MPI_INT, r, TAG_TRACE, MPI_COMM_WORLD);
+            MPI_Recv(&count, 1, MPI_INT, r, TAG_TRACE, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            if(count > perf_trace_events) {
+               message("Error; rank %d has %d trace events, more than -perf_trace_events\n", r, count);
+               MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            MPI_Recv(events, count, event_type, r, TAG_TRACE, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+         }
+         if(f)
+            write_events(f, events, count, r);
+      }
+      if(f) {
+         fprintf(f, "\n]}\n");
+         fclose(f);
+         message("Trace written to %s\n", perf_trace_filename);
+      }
+      if(total_lost > 0.)
+         message("%.0f trace events did not fit in -perf_trace_events and were dropped.\n", total_lost);
+   }
+   else {
+      int ready;
+      MPI_Recv(&ready, 1, MPI_INT, 0, TAG_TRACE, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      if(!ready)
+         count = 0;
+      MPI_Send(&count, 1, MPI_INT, 0, TAG_TRACE, MPI_COMM_WORLD);
+      MPI_Send(events, count, event_type, 0, TAG_TRACE, MPI_COMM_WORLD);
+   }
+   MPI_Type_free(&event_type);
+   free(events);
+   events = NULL;
+   tracing = 0;
+}
+
+void perf_finish()
+{
+   struct PerfCounters *all = NULL;
+   int rank, size, n = (int)(sizeof(struct PerfCounters) / sizeof(double));
+
+   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+   MPI_Comm_size(MPI_COMM_WORLD, &size);
+   update_counters();
+   if(rank == 0)
+      all = (struct PerfCounters *)malloc(sizeof(struct PerfCounters) * size);
+   MPI_Gather(&counters, n, MPI_DOUBLE, all, n, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+   if(rank == 0) {
+      char line[1024] = { 0 };
+      int p, len = 0;
+      for(p = 0; p < PERF_NPHASES; p++) {
+         if(all[0].seconds[p] > 0.)
+            len += snprintf(line + len, sizeof(line) - len, " %s %.2fs", phase_names[p], all[0].seconds[p]);
+      }
+      message("Rank 0 time:%s\n", line);
+      if(perf_report_filename[0]) {
+         write_report(all, size, 1, (size_t)pairs.count);
+         message("Performance report written to %s\n", perf_report_filename);
+      }
+      free(all);
+   }
+   if(perf_trace_filename[0] && perf_trace_events > 0)
+      finish_trace(rank, size);
+}
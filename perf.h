@@ -0,0 +1,67 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stddef.h>
+
+/* Where a rank spends its time.  Phases nest; time is charged to the
+ * innermost one, so a rank's phases add up to its wall time.  Each is
+ * also a PETSc log stage, so -log_view breaks PETSc's own events down
+ * the same way. */
+enum PerfPhase
+{
+   PERF_OTHER,         /* outside every phase */
+   PERF_PARSE,         /* reading the habitat and the nodes, making pairs */
+   PERF_ISLANDS,
+   PERF_CONDUCTANCE,
+   PERF_DISTRIBUTE,    /* sending or receiving matrix rows */
+   PERF_KSP_SETUP,
+   PERF_KSP_SOLVE,
+   PERF_GATHER,        /* moving solutions to rank 0 */
+   PERF_CURRENT,
+   PERF_ACCUMULATE,
+   PERF_OUTPUT,
+   PERF_IDLE,          /* rank 0 waiting on workers, workers waiting for a pair */
+   PERF_NPHASES
+};
+
+extern char     perf_report_filename[PATH_MAX];
+extern PetscInt perf_report_interval;
+extern char     perf_trace_filename[PATH_MAX];   /* -perf_trace */
+extern PetscInt perf_trace_events;               /* most events kept per rank */
+
+/* Only the main thread of a rank may push and pop phases */
+void perf_init();
+void perf_push(int phase);
+void perf_pop();
+
+void perf_sent(size_t bytes);
+void perf_received(size_t bytes);
+void perf_solved(long iterations);            /* a solve this rank took part in */
+void perf_pair_solved(long iterations);       /* rank 0: a pair came back */
+
+/* rank 0: write a report of its own counters every
+ * perf_report_interval pairs */
+void perf_interim(size_t done);
+
+/* Collective: gather every rank's counters and write the final report,
+ * and the merged trace when -perf_trace is given */
+void perf_finish();
+
+#endif  /* PERF_H */
@@ -0,0 +1,190 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+#include <petsc.h>
+
+#include "util.h"
+#include "nodelist.h"
+#include "sampler.h"
+
+PetscBool  adaptive_sampling = PETSC_FALSE;
+PetscInt   sample_distance_classes = 8;
+PetscInt   sample_node_groups = 4;
+PetscReal  sample_exploration = 0.1;  /* fraction of draws made proportional to stratum size */
+
+static int cmp_double(const void *a, const void *b)
+{
+   double x = *(const double *)a, y = *(const double *)b;
+   return x < y ? -1 : x > y;
+}
+
+/* Distance class boundaries at the quantiles of the pair distances, so
+ * every class holds roughly the same number of pairs */
+static double *distance_classes(struct PointPairs *pp, int nclasses)
+{
+   double *d, *bounds;
+   size_t i;
+   int k;
+
+   d = (double *)malloc(sizeof(double) * pp->count);
+   bounds = (double *)malloc(sizeof(double) * nclasses);
+   for(i = 0; i < pp->count; i++) {
+      struct Pair p = pair_at(pp, i);
+      d[i] = dist(p.p1, p.p2);
+   }
+   qsort(d, pp->count, sizeof(double), cmp_double);
+   for(k = 0; k < nclasses - 1; k++)
+      bounds[k] = pp->count > 0 ? d[(pp->count * (k + 1)) / nclasses] : INFINITY;
+   bounds[nclasses - 1] = INFINITY;
+   free(d);
+   return bounds;
+}
+
+static size_t stratum_of(struct PointPairs *pp, size_t i, double *bounds)
+{
+   struct Pair p = pair_at(pp, i);
+   double d = dist(p.p1, p.p2);
+   size_t dclass = 0, ngroup;
+
+   while(d > bounds[dclass])
+      ++dclass;
+   ngroup = (p.p1.index * sample_node_groups) / MAX(pp->ncount, 1);
+   if(ngroup >= sample_node_groups)
+      ngroup = sample_node_groups - 1;
+   return dclass * sample_node_groups + ngroup;
+}
+
+void init_sampler(struct Sampler *S, struct PointPairs *pp)
+{
+   double *bounds;
+   size_t  i, h, *stratum;
+
+   if(sample_distance_classes < 1)
+      sample_distance_classes = 1;
+   if(sample_node_groups < 1)
+      sample_node_groups = 1;
+
+   S->nstrata = sample_distance_classes * sample_node_groups;
+   S->population = pp->count;
+   S->strata = (struct Stratum *)calloc(S->nstrata, sizeof(struct Stratum));
+   rng_seed(&S->rng, random_seed);
+
+   bounds = distance_classes(pp, sample_distance_classes);
+   stratum = (size_t *)malloc(sizeof(size_t) * pp->count);
+   for(i = 0; i < pp->count; i++) {
+      stratum[i] = stratum_of(pp, i, bounds);
+      ++S->strata[stratum[i]].count;
+   }
+   for(h = 0; h < S->nstrata; h++)
+      S->strata[h].pairs = (size_t *)malloc(sizeof(size_t) * MAX(S->strata[h].count, 1));
+   for(h = 0; h < S->nstrata; h++)
+      S->strata[h].count = 0;
+   for(i = 0; i < pp->count; i++) {
+      struct Stratum *st = &S->strata[stratum[i]];
+      st->pairs[st->count++] = i;
+   }
+
+   free(stratum);
+   free(bounds);
+   message("Adaptive sampling over %zu strata (%d distance classes x %d node groups).\n",
+           S->nstrata, (int)sample_distance_classes, (int)sample_node_groups);
+}
+
+/* Selection probabilities follow the optimal (Neyman) allocation for a
+ * sum estimator: proportional to stratum size times the root mean square
+ * of the contribution each pair made to the summed map.  Strata without
+ * observations borrow the largest estimate so they are explored early,
+ * and a fixed fraction of draws stays proportional to stratum size so
+ * that every stratum keeps a non-zero probability. */
+static void update_probabilities(struct Sampler *S)
+{
+   double prior = 0., total = 0.;
+   size_t h;
+
+   for(h = 0; h < S->nstrata; h++) {
+      struct Stratum *st = &S->strata[h];
+      if(st->n > 0)
+         prior = MAX(prior, sqrt(st->sum2 / st->n));
+   }
+   if(prior <= 0.)
+      prior = 1.;
+
+   for(h = 0; h < S->nstrata; h++) {
+      struct Stratum *st = &S->strata[h];
+      double rms = st->n > 0 ? sqrt(st->sum2 / st->n) : prior;
+      st->prob = st->count * rms;
+      total += st->prob;
+   }
+   for(h = 0; h < S->nstrata; h++) {
+      struct Stratum *st = &S->strata[h];
+      double share = (double)st->count / S->population;
+      st->prob = (1. - sample_exploration) * (total > 0. ? st->prob / total : share)
+               + sample_exploration * share;
+   }
+}
+
+/* Draw the next pair: a stratum by the current probabilities, then a
+ * pair of it uniformly, with replacement.  `weight` is the pair's
+ * Hansen-Hurwitz weight, its share of the population over its chance of
+ * being drawn, (N_h/N)/p_h.  The probabilities only depend on earlier
+ * draws, so every weighted current has expectation the mean current of
+ * all N pairs, and the sum of n of them is an unbiased estimate of n/N
+ * times the sum over every pair, as n pairs of the plain order are. */
+size_t sampler_next(struct Sampler *S, size_t *stratum, double *weight)
+{
+   struct Stratum *st;
+   double u, cumulative = 0.;
+   size_t h, last = 0;
+
+   update_probabilities(S);
+   u = rng_double(&S->rng);
+   for(h = 0; h < S->nstrata; h++) {
+      if(S->strata[h].count == 0)
+         continue;
+      last = h;
+      cumulative += S->strata[h].prob;
+      if(u < cumulative)
+         break;
+   }
+   if(h == S->nstrata)  /* rounding */
+      h = last;
+
+   st = &S->strata[h];
+   *stratum = h;
+   *weight = ((double)st->count / S->population) / st->prob;
+   return st->pairs[rng_uniform(&S->rng, st->count)];
+}
+
+void sampler_observe(struct Sampler *S, size_t stratum, double contribution)
+{
+   struct Stratum *st = &S->strata[stratum];
+   ++st->n;
+   st->sum2 += contribution * contribution;
+}
+
+void free_sampler(struct Sampler *S)
+{
+   size_t h;
+   for(h = 0; h < S->nstrata; h++)
+      free(S->strata[h].pairs);
+   free(S->strata);
+}
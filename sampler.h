@@ -0,0 +1,56 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "nodelist.h"
+#include "util.h"
+
+extern PetscBool  adaptive_sampling;
+extern PetscInt   sample_distance_classes;
+extern PetscInt   sample_node_groups;
+extern PetscReal  sample_exploration;
+
+/* A group of pairs with similar distance and source node.  Pairs are
+ * drawn with replacement, so a pair may be solved more than once; that
+ * keeps the weights exact whatever the probabilities do.  Every pair is
+ * listed in its stratum, so the sampler's memory grows with the number
+ * of pairs. */
+struct Stratum
+{
+   size_t *pairs;       /* indices into PointPairs */
+   size_t  count;
+   unsigned long n;     /* number of observed contributions */
+   double  sum2;        /* sum of squared contributions */
+   double  prob;        /* current selection probability */
+};
+
+struct Sampler
+{
+   struct Stratum *strata;
+   size_t  nstrata;
+   size_t  population;  /* total number of pairs */
+   struct Rng rng;
+};
+
+void   init_sampler(struct Sampler *S, struct PointPairs *pp);
+size_t sampler_next(struct Sampler *S, size_t *stratum, double *weight);
+void   sampler_observe(struct Sampler *S, size_t stratum, double contribution);
+void   free_sampler(struct Sampler *S);
+
+#endif  /* SAMPLER_H */
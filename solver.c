@@ -0,0 +1,342 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <mpi.h>
+#include <petsc.h>
+
+#include "deflation.h"
+#include "output.h"
+#include "solver.h"
+#include "util.h"
+
+char      solver_log_filename[PATH_MAX] = { 0 };
+PetscBool autotune = PETSC_FALSE;
+PetscInt  autotune_trials = 1;
+PetscReal solve_accuracy = 0.;
+PetscBool symmetric_storage = PETSC_FALSE;
+
+/* Candidates tried by -autotune.  Each runs with the KSP settings in
+ * force for configuration 0, so only the preconditioner differs. */
+static const struct
+{
+   const char *name;
+   const char *options;
+} candidates[] = {
+   { "default",            NULL },
+   { "boomeramg-theta0.5", "-pc_type hypre -pc_hypre_type boomeramg "
+                           "-pc_hypre_boomeramg_strong_threshold 0.5" },
+   { "boomeramg-hmis",     "-pc_type hypre -pc_hypre_type boomeramg "
+                           "-pc_hypre_boomeramg_coarsen_type HMIS "
+                           "-pc_hypre_boomeramg_interp_type ext+i "
+                           "-pc_hypre_boomeramg_strong_threshold 0.7" },
+   { "boomeramg-l1",       "-pc_type hypre -pc_hypre_type boomeramg "
+                           "-pc_hypre_boomeramg_relax_type_all l1scaled-SOR/Jacobi" },
+   { "gamg",               "-pc_type gamg -pc_gamg_type agg -pc_gamg_agg_nsmooths 1 "
+                           "-mg_levels_ksp_type chebyshev -mg_levels_pc_type jacobi" },
+   { "bjacobi-icc",        "-pc_type bjacobi -sub_pc_type icc" },
+};
+
+#define NCANDIDATES ((int)(sizeof(candidates) / sizeof(candidates[0])))
+
+/* KSP options carried over from configuration 0 to the candidates */
+static const char *ksp_keys[] = {
+   "ksp_type", "ksp_atol", "ksp_rtol", "ksp_divtol", "ksp_max_it", "ksp_norm_type",
+};
+
+static char prefixes[NCANDIDATES][32];
+
+/* Trials on rank 0 */
+static struct
+{
+   int    sent;           /* pairs handed to candidates so far */
+   int    chosen;         /* configuration in use, -1 while trying */
+   int    solves[NCANDIDATES];
+   int    failed[NCANDIDATES];
+   double seconds[NCANDIDATES];
+} tuning = { 0, -1 };
+
+static FILE *solver_log = NULL;
+
+/* The residual of a row is the current that fails to balance at that
+ * cell, so its largest entry is held to the current density that the
+ * maps can show: -solve_accuracy, or output_threshold below which
+ * currents are written as zero.  R_eff = b'x is out by at most
+ * |x|_inf |r|_1, held to half its last printed digit.  The KSP stops on
+ * the unpreconditioned residual where it can, which is not quite either
+ * norm, so its tolerance is scaled by how far the last result missed or
+ * beat them. */
+#define MAX_REFINEMENTS     3
+#define MIN_TOLERANCE_SCALE 1e-6
+
+static double tolerance_scale = 1.;
+
+static double current_tolerance()
+{
+   return MAX(solve_accuracy, output_threshold);
+}
+
+static double reff_tolerance()
+{
+   return 0.5 * pow(10., -REFF_DECIMALS);
+}
+
+/* Append `options` to `buf` with every option name given `prefix` */
+static void append_prefixed(char *buf, size_t len, const char *prefix, const char *options)
+{
+   char *copy = strdup(options);
+   char *save, *tok;
+
+   for(tok = strtok_r(copy, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+      size_t used = strlen(buf);
+      if(tok[0] == '-')
+         snprintf(buf + used, len - used, "-%s%s ", prefix, tok + 1);
+      else
+         snprintf(buf + used, len - used, "%s ", tok);
+   }
+   free(copy);
+}
+
+/* hypre and GAMG need the whole matrix, so with -symmetric_storage
+ * they give way to block Jacobi with incomplete Cholesky, which works
+ * from the upper triangle.  Only that candidate would be left to tune. */
+static void symmetric_preconditioner()
+{
+   char pc_type[64] = { 0 };
+   PetscBool flg;
+   int rank;
+
+   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+   PetscOptionsGetString(PETSC_NULL, NULL, "-pc_type", pc_type, sizeof(pc_type), &flg);
+   if(strcmp(pc_type, PCHYPRE) == 0 || strcmp(pc_type, PCGAMG) == 0) {
+      PetscOptionsInsertString(NULL, "-pc_type bjacobi -sub_pc_type icc");
+      if(rank == 0)
+         message("Symmetric storage: using -pc_type bjacobi -sub_pc_type icc instead of %s.\n", pc_type);
+   }
+   if(autotune && rank == 0)
+      message("Symmetric storage: -autotune is ignored.\n");
+   autotune = PETSC_FALSE;
+}
+
+/* Read here rather than with the others, since every rank sets up the
+ * candidates' options */
+void solver_init()
+{
+   PetscBool flg;
+   char buf[4096];
+   int  c, k;
+
+   PetscOptionsGetString(PETSC_NULL, NULL, "-solver_log",      solver_log_filename, PATH_MAX, &flg);
+   PetscOptionsGetBool(PETSC_NULL,   NULL, "-autotune",        &autotune,                     &flg);
+   PetscOptionsGetInt(PETSC_NULL,    NULL, "-autotune_trials", &autotune_trials,              &flg);
+   PetscOptionsGetReal(PETSC_NULL,   NULL, "-solve_accuracy",  &solve_accuracy,               &flg);
+   PetscOptionsGetBool(PETSC_NULL,   NULL, "-symmetric_storage", &symmetric_storage,          &flg);
+   PetscOptionsGetInt(PETSC_NULL,    NULL, "-deflation_vectors", &deflation_vectors,          &flg);
+   PetscOptionsGetInt(PETSC_NULL,    NULL, "-deflation_harvest", &deflation_harvest,          &flg);
+   /* every rank that solves needs the threshold for its tolerance */
+   PetscOptionsGetReal(PETSC_NULL,   NULL, "-output_threshold", &output_threshold,             &flg);
+   if(autotune_trials < 1)
+      autotune_trials = 1;
+   if(symmetric_storage)
+      symmetric_preconditioner();
+   if(!autotune)
+      return;
+
+   for(c = 1; c < NCANDIDATES; c++) {
+      snprintf(prefixes[c], sizeof(prefixes[c]), "autotune%d_", c);
+      buf[0] = '\0';
+      for(k = 0; k < (int)(sizeof(ksp_keys) / sizeof(ksp_keys[0])); k++) {
+         char key[64], value[256];
+         snprintf(key, sizeof(key), "-%s", ksp_keys[k]);
+         PetscOptionsGetString(PETSC_NULL, NULL, key, value, sizeof(value), &flg);
+         if(flg) {
+            size_t used = strlen(buf);
+            snprintf(buf + used, sizeof(buf) - used, "-%s%s %s ", prefixes[c], ksp_keys[k], value);
+         }
+      }
+      append_prefixed(buf, sizeof(buf), prefixes[c], candidates[c].options);
+      PetscOptionsInsertString(NULL, buf);
+   }
+}
+
+const char *solver_prefix(int config)
+{
+   return config > 0 && config < NCANDIDATES ? prefixes[config] : NULL;
+}
+
+const char *solver_name(int config)
+{
+   return config >= 0 && config < NCANDIDATES ? candidates[config].name : "unknown";
+}
+
+void solver_set_tolerance(KSP ksp)
+{
+   KSPType type;
+
+   if(solve_accuracy <= 0.)
+      return;
+   KSPGetType(ksp, &type);
+   if(strcmp(type, KSPCG) == 0)
+      KSPSetNormType(ksp, KSP_NORM_UNPRECONDITIONED);
+   KSPSetTolerances(ksp, 0., current_tolerance() * tolerance_scale, PETSC_DEFAULT, PETSC_DEFAULT);
+}
+
+/* How many times over the bounds the residual of `x` is; at most 1 when
+ * the outputs are as good as they can show */
+static PetscErrorCode residual_excess(Mat A, Vec b, Vec x, double *excess)
+{
+   Vec       r;
+   PetscReal rmax, rsum, vmax;
+   PetscErrorCode ierr;
+
+   ierr = VecDuplicate(b, &r);            CHKERRQ(ierr);
+   ierr = MatMult(A, x, r);               CHKERRQ(ierr);
+   ierr = VecAYPX(r, -1., b);             CHKERRQ(ierr);
+   ierr = VecNorm(r, NORM_INFINITY, &rmax);  CHKERRQ(ierr);
+   ierr = VecNorm(r, NORM_1, &rsum);         CHKERRQ(ierr);
+   ierr = VecNorm(x, NORM_INFINITY, &vmax);  CHKERRQ(ierr);
+   ierr = VecDestroy(&r);                 CHKERRQ(ierr);
+   *excess = MAX(rmax / current_tolerance(), rsum * vmax / reff_tolerance());
+   return 0;
+}
+
+PetscErrorCode solver_solve(KSP ksp, Mat A, Vec b, Vec x, PetscInt *iterations, int *refinements)
+{
+   KSPConvergedReason reason;
+   PetscInt n;
+   double   excess;
+   PetscErrorCode ierr;
+
+   ierr = KSPSolve(ksp, b, x);  CHKERRQ(ierr);
+   KSPGetIterationNumber(ksp, iterations);
+   *refinements = 0;
+   if(solve_accuracy <= 0.)
+      return 0;
+   while(1) {
+      KSPGetConvergedReason(ksp, &reason);
+      if(reason <= 0)
+         return 0;
+      ierr = residual_excess(A, b, x, &excess);  CHKERRQ(ierr);
+      if(excess > 1.)
+         tolerance_scale = MAX(tolerance_scale / (10. * excess), MIN_TOLERANCE_SCALE);
+      else if(excess < 0.1)
+         tolerance_scale = MIN(tolerance_scale * 2., 1.);
+      if(excess <= 1. || *refinements == MAX_REFINEMENTS)
+         return 0;
+      /* carry on from x with the tighter tolerance */
+      ++(*refinements);
+      solver_set_tolerance(ksp);
+      ierr = KSPSetInitialGuessNonzero(ksp, PETSC_TRUE);  CHKERRQ(ierr);
+      ierr = KSPSolve(ksp, b, x);  CHKERRQ(ierr);
+      KSPGetIterationNumber(ksp, &n);
+      *iterations += n;
+   }
+}
+
+/* Candidate c gets the c'th run of `autotune_trials` pairs.  Pairs sent
+ * after the last trial but before its result is back use configuration
+ * 0. */
+int solver_next_config()
+{
+   if(!autotune)
+      return 0;
+   if(tuning.chosen >= 0)
+      return tuning.chosen;
+   if(tuning.sent < NCANDIDATES * autotune_trials)
+      return tuning.sent++ / autotune_trials;
+   return 0;
+}
+
+/* The quickest candidate that converged on every trial */
+static void choose()
+{
+   double best = 0.;
+   int    c, chosen = -1;
+
+   for(c = 0; c < NCANDIDATES; c++) {
+      double mean = tuning.seconds[c] / MAX(tuning.solves[c], 1);
+      if(tuning.failed[c]) {
+         message("Autotune: %s did not converge.\n", candidates[c].name);
+         continue;
+      }
+      message("Autotune: %s took %.3lf s per solve.\n", candidates[c].name, mean);
+      if(chosen < 0 || mean < best) {
+         best = mean;
+         chosen = c;
+      }
+   }
+   tuning.chosen = MAX(chosen, 0);
+   message("Autotune: using %s for the remaining pairs.\n", candidates[tuning.chosen].name);
+}
+
+static void log_solve(long pair, int group, const double *stats)
+{
+   int reason = (int)stats[SOLVE_REASON];
+
+   if(solver_log == NULL) {
+      solver_log = fopen(solver_log_filename, "w");
+      if(solver_log == NULL) {
+         message("Error; could not write the solver log to %s\n", solver_log_filename);
+         solver_log_filename[0] = '\0';
+         return;
+      }
+      fprintf(solver_log, "pair,group,config,iterations,reason,residual,setup_s,solve_s,retried,refinements,deflated\n");
+   }
+   fprintf(solver_log, "%ld,%d,%s,%ld,%s,%.6e,%.6f,%.6f,%d,%d,%d\n",
+           pair, group, solver_name((int)stats[SOLVE_CONFIG]),
+           (long)stats[SOLVE_ITERATIONS], KSPConvergedReasons[reason],
+           stats[SOLVE_RESIDUAL], stats[SOLVE_SETUP_TIME], stats[SOLVE_SOLVE_TIME],
+           (int)stats[SOLVE_RETRIED], (int)stats[SOLVE_REFINEMENTS], (int)stats[SOLVE_DEFLATED]);
+   fflush(solver_log);
+}
+
+void solver_observe(long pair, int group, const double *stats)
+{
+   int config = (int)stats[SOLVE_CONFIG];
+   int reason = (int)stats[SOLVE_REASON];
+
+   if(reason <= 0)
+      message("Pair %ld did not converge with %s (%s)%s.\n", pair, solver_name(config),
+              KSPConvergedReasons[reason], stats[SOLVE_RETRIED] > 0 ? "; solved again with the default" : "");
+   if(solver_log_filename[0])
+      log_solve(pair, group, stats);
+
+   /* only the trials count; configuration 0 also runs between the last
+    * trial and the choice */
+   if(autotune && tuning.chosen < 0 && config >= 0 && config < NCANDIDATES
+      && tuning.solves[config] < autotune_trials) {
+      int c, total = 0;
+      ++tuning.solves[config];
+      tuning.seconds[config] += stats[SOLVE_SETUP_TIME] + stats[SOLVE_SOLVE_TIME];
+      if(reason <= 0)
+         tuning.failed[config] = 1;
+      for(c = 0; c < NCANDIDATES; c++)
+         total += tuning.solves[c];
+      if(total == NCANDIDATES * autotune_trials)
+         choose();
+   }
+}
+
+void solver_finish()
+{
+   if(solver_log)
+      fclose(solver_log);
+   solver_log = NULL;
+}
@@ -0,0 +1,65 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include "util.h"
+
+extern char      solver_log_filename[PATH_MAX];   /* -solver_log */
+extern PetscBool autotune;                        /* -autotune */
+extern PetscInt  autotune_trials;                 /* pairs given to each candidate */
+extern PetscReal solve_accuracy;                  /* -solve_accuracy, 0 keeps the KSP's tolerances */
+extern PetscBool symmetric_storage;               /* -symmetric_storage: SBAIJ, upper triangle only */
+
+/* What a group reports about one solve.  All doubles so that they go to
+ * rank 0 as one array, along with the id of the pair. */
+enum SolveStat
+{
+   SOLVE_ID,
+   SOLVE_ITERATIONS,
+   SOLVE_REASON,        /* KSPConvergedReason, negative when it failed */
+   SOLVE_RESIDUAL,
+   SOLVE_SETUP_TIME,    /* seconds */
+   SOLVE_SOLVE_TIME,
+   SOLVE_CONFIG,        /* solver configuration the pair was given */
+   SOLVE_RETRIED,       /* 1 when it failed and was solved again with configuration 0 */
+   SOLVE_REFINEMENTS,   /* times the result fell short of -solve_accuracy and was improved */
+   SOLVE_DEFLATED,      /* directions deflated, see deflation.h */
+   SOLVE_NSTATS
+};
+
+/* Configuration 0 is the solver set up by the command line.  With
+ * -autotune the others are candidates, each a set of options under its
+ * own prefix. */
+void        solver_init();
+const char *solver_prefix(int config);    /* NULL for configuration 0 */
+const char *solver_name(int config);
+
+/* With -solve_accuracy the KSP's tolerance comes from the accuracy of
+ * the outputs, and solver_solve() checks the result against it and
+ * carries on from it when it falls short.  Set the tolerance before
+ * KSPSetUp(). */
+void           solver_set_tolerance(KSP ksp);
+PetscErrorCode solver_solve(KSP ksp, Mat A, Vec b, Vec x, PetscInt *iterations, int *refinements);
+
+/* rank 0: configuration for the next pair sent out, and what came back */
+int  solver_next_config();
+void solver_observe(long pair, int group, const double *stats);
+void solver_finish();
+
+#endif  /* SOLVER_H */
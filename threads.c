@@ -0,0 +1,163 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <petsc.h>
+
+#include "threads.h"
+#include "util.h"
+
+PetscInt num_threads = 1;
+
+/* Threads are started on the first parallel_for and then wait for work,
+ * so a parallel loop costs a wake-up rather than a thread creation */
+struct ThreadTask
+{
+   parallel_func func;
+   void  *arg;
+   size_t start, end;
+   int    tid;
+};
+
+static struct
+{
+   pthread_t        *threads;
+   struct ThreadTask *tasks;
+   int               nthreads;   /* including the calling thread */
+   unsigned long     generation; /* bumped for every loop */
+   unsigned long     started_at; /* generation when the threads started */
+   int               pending;    /* tasks not yet finished */
+   int               stopping;
+   pthread_mutex_t   lock;
+   pthread_cond_t    work, done;
+} pool = { NULL, NULL, 1, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER,
+           PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* set in pool threads and while the caller runs its own share, so a
+ * parallel_for inside a parallel_for runs inline */
+static __thread int in_parallel = 0;
+
+static void *thread_main(void *p)
+{
+   struct ThreadTask *t = (struct ThreadTask *)p;
+   unsigned long seen;
+
+   in_parallel = 1;
+   pthread_mutex_lock(&pool.lock);
+   seen = pool.started_at;
+   while(1) {
+      while(pool.generation == seen && !pool.stopping)
+         pthread_cond_wait(&pool.work, &pool.lock);
+      if(pool.stopping)
+         break;
+      seen = pool.generation;
+      pthread_mutex_unlock(&pool.lock);
+      if(t->func && t->start < t->end)
+         t->func(t->start, t->end, t->tid, t->arg);
+      pthread_mutex_lock(&pool.lock);
+      if(--pool.pending == 0)
+         pthread_cond_signal(&pool.done);
+   }
+   pthread_mutex_unlock(&pool.lock);
+   return NULL;
+}
+
+static void start_pool(int nthreads)
+{
+   int i;
+
+   free_threads();
+   pool.threads = (pthread_t *)malloc(sizeof(pthread_t) * nthreads);
+   pool.tasks = (struct ThreadTask *)calloc(nthreads, sizeof(struct ThreadTask));
+   pool.nthreads = 1;
+   pool.stopping = 0;
+   pool.started_at = pool.generation;
+   for(i = 1; i < nthreads; i++) {
+      pool.tasks[i].tid = i;
+      if(pthread_create(&pool.threads[i], NULL, thread_main, &pool.tasks[i]) != 0) {
+         message("Error; could not create thread %d, using %d\n", i, i);
+         break;
+      }
+      pool.nthreads = i + 1;
+   }
+}
+
+void free_threads()
+{
+   int i;
+
+   if(pool.threads == NULL)
+      return;
+   pthread_mutex_lock(&pool.lock);
+   pool.stopping = 1;
+   pthread_cond_broadcast(&pool.work);
+   pthread_mutex_unlock(&pool.lock);
+   for(i = 1; i < pool.nthreads; i++)
+      pthread_join(pool.threads[i], NULL);
+   free(pool.threads);
+   free(pool.tasks);
+   pool.threads = NULL;
+   pool.tasks = NULL;
+   pool.nthreads = 1;
+}
+
+/* Split [0,n) into contiguous chunks, one per thread.  The calling
+ * thread takes the first chunk. */
+void parallel_for(size_t n, parallel_func func, void *arg)
+{
+   int i, nthreads = (int)MIN((size_t)MAX(num_threads, 1), n);
+
+   if(nthreads <= 1 || in_parallel) {
+      if(n > 0)
+         func(0, n, 0, arg);
+      return;
+   }
+   if(pool.threads == NULL || pool.nthreads != MAX(num_threads, 1))
+      start_pool((int)MAX(num_threads, 1));
+   nthreads = MIN(nthreads, pool.nthreads);
+
+   pthread_mutex_lock(&pool.lock);
+   for(i = 0; i < pool.nthreads; i++) {
+      pool.tasks[i].func  = i < nthreads ? func : NULL;
+      pool.tasks[i].arg   = arg;
+      pool.tasks[i].start = (n * i) / nthreads;
+      pool.tasks[i].end   = i < nthreads ? (n * (i + 1)) / nthreads : 0;
+   }
+   pool.pending = pool.nthreads - 1;
+   ++pool.generation;
+   pthread_cond_broadcast(&pool.work);
+   pthread_mutex_unlock(&pool.lock);
+
+   in_parallel = 1;
+   func(pool.tasks[0].start, pool.tasks[0].end, 0, arg);
+   in_parallel = 0;
+
+   pthread_mutex_lock(&pool.lock);
+   while(pool.pending > 0)
+      pthread_cond_wait(&pool.done, &pool.lock);
+   pthread_mutex_unlock(&pool.lock);
+}
+
+void parallel_for_if(int parallel, size_t n, parallel_func func, void *arg)
+{
+   if(parallel)
+      parallel_for(n, func, arg);
+   else if(n > 0)
+      func(0, n, 0, arg);
+}
@@ -0,0 +1,38 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <stddef.h>
+
+extern PetscInt num_threads;
+
+/* Work function for parallel_for: process items [start,end) */
+typedef void (*parallel_func)(size_t start, size_t end, int tid, void *arg);
+
+void parallel_for(size_t n, parallel_func func, void *arg);
+
+/* parallel_for, or one call on this thread unless `parallel` is set.
+ * Loops over tiled arrays run on one thread, since threads must not
+ * share them. */
+void parallel_for_if(int parallel, size_t n, parallel_func func, void *arg);
+
+/* Stop the pool's threads; the next parallel_for starts them again */
+void free_threads();
+
+#endif  /* THREADS_H */
@@ -0,0 +1,199 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <petsc.h>
+
+#include "tiles.h"
+#include "util.h"
+
+PetscInt tile_rows  = 0;
+PetscInt tile_cache = 16;
+char     tile_directory[PATH_MAX] = ".";
+
+/* Raster passes keep a row and its neighbours in use at the same time */
+#define MIN_TILE_CACHE 4
+
+void tile_init(struct TileArray *T, size_t elsize, size_t count, size_t tile_len)
+{
+   char path[PATH_MAX + 32];
+   int  s;
+
+   T->elsize = elsize;
+   T->count  = count;
+   T->fd     = -1;
+   T->data   = NULL;
+   T->slots  = NULL;
+   T->nslots = 0;
+   T->last   = 0;
+   T->clock  = 0;
+   T->win    = MPI_WIN_NULL;
+
+   if(tile_rows <= 0 || count <= tile_len) {
+      T->tile_len = MAX(count, 1);
+      PetscMalloc(elsize * T->tile_len, &T->data);
+      memset(T->data, 0, elsize * T->tile_len);
+      return;
+   }
+
+   /* the file is unlinked straight away; it goes when the array is freed
+    * or the process exits */
+   T->tile_len = tile_len;
+   snprintf(path, sizeof(path), "%s/gflow-tiles-XXXXXX", tile_directory);
+   T->fd = mkstemp(path);
+   if(T->fd == -1) {
+      message("Error; could not create a scratch file in %s\n", tile_directory);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
+   unlink(path);
+   if(ftruncate(T->fd, (off_t)(elsize * count)) != 0) {
+      message("Error; could not allocate %zu bytes in %s\n", elsize * count, tile_directory);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
+   T->nslots = MAX(tile_cache, MIN_TILE_CACHE);
+   PetscMalloc(sizeof(struct Tile) * T->nslots, &T->slots);
+   for(s = 0; s < T->nslots; s++) {
+      T->slots[s].number = -1;
+      T->slots[s].map    = NULL;
+      T->slots[s].used   = 0;
+   }
+}
+
+void tile_free(struct TileArray *T)
+{
+   int s;
+
+   if(T->win != MPI_WIN_NULL) {
+      MPI_Win_free(&T->win);
+      T->data = NULL;
+      return;
+   }
+   if(T->data) {
+      PetscFree(T->data);
+      return;
+   }
+   for(s = 0; s < T->nslots; s++) {
+      if(T->slots[s].map)
+         munmap(T->slots[s].map, T->slots[s].length);
+   }
+   PetscFree(T->slots);
+   close(T->fd);
+   T->fd = -1;
+}
+
+int tile_share(struct TileArray *T, MPI_Comm node)
+{
+   uint64_t shape[3];   /* element size, count, whether it is in memory */
+   MPI_Aint size;
+   char    *base;
+   int      nrank, disp;
+
+   MPI_Comm_rank(node, &nrank);
+   if(nrank == 0) {
+      shape[0] = T->elsize;
+      shape[1] = T->count;
+      shape[2] = T->data != NULL;
+   }
+   MPI_Bcast(shape, 3, MPI_UINT64_T, 0, node);
+   if(!shape[2])
+      return 0;
+
+   if(nrank != 0) {
+      T->elsize   = shape[0];
+      T->count    = shape[1];
+      T->tile_len = MAX(T->count, 1);
+      T->fd       = -1;
+      T->slots    = NULL;
+      T->nslots   = 0;
+      T->last     = 0;
+      T->clock    = 0;
+   }
+   size = nrank == 0 ? (MPI_Aint)(T->elsize * T->tile_len) : 0;
+   MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, node, &base, &T->win);
+   if(nrank == 0) {
+      memcpy(base, T->data, size);
+      PetscFree(T->data);
+   }
+   else {
+      MPI_Win_shared_query(T->win, 0, &size, &disp, &base);
+   }
+   T->data = base;
+   /* the copy is complete before anyone reads it */
+   MPI_Win_fence(0, T->win);
+   return 1;
+}
+
+/* Map tile `number` into the least recently used slot */
+static struct Tile *map_tile(struct TileArray *T, size_t number)
+{
+   static long page_size = 0;
+   struct Tile *t;
+   off_t  first, aligned;
+   size_t bytes;
+   int    s, lru = 0;
+
+   if(page_size == 0)
+      page_size = sysconf(_SC_PAGESIZE);
+
+   for(s = 1; s < T->nslots; s++) {
+      if(T->slots[s].used < T->slots[lru].used)
+         lru = s;
+   }
+   t = &T->slots[lru];
+   if(t->map)
+      munmap(t->map, t->length);
+
+   first   = (off_t)(number * T->tile_len * T->elsize);
+   aligned = first - first % page_size;
+   bytes   = MIN(T->tile_len, T->count - number * T->tile_len) * T->elsize;
+   t->length = bytes + (first - aligned);
+   t->map = mmap(NULL, t->length, PROT_READ | PROT_WRITE, MAP_SHARED, T->fd, aligned);
+   if(t->map == MAP_FAILED) {
+      message("Error; could not map tile %zu\n", number);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
+   t->data   = (char *)t->map + (first - aligned);
+   t->number = number;
+   T->last   = lru;
+   return t;
+}
+
+void *tile_fetch(struct TileArray *T, size_t k)
+{
+   size_t number = k / T->tile_len;
+   struct Tile *t = &T->slots[T->last];
+   int s;
+
+   if(t->number != number) {
+      t = NULL;
+      for(s = 0; s < T->nslots; s++) {
+         if(T->slots[s].number == number) {
+            t = &T->slots[s];
+            T->last = s;
+            break;
+         }
+      }
+      if(t == NULL)
+         t = map_tile(T, number);
+   }
+   t->used = ++T->clock;
+   return t->data + (k - number * T->tile_len) * T->elsize;
+}
@@ -0,0 +1,90 @@
+/* Copyright (C) 2016, Edward Duffy <eduffy@clemson.edu>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef TILES_H
+#define TILES_H
+
+#include <stddef.h>
+#include <limits.h>
+#include <mpi.h>
+#include <petsc.h>
+
+/* Rasters and per-cell arrays are either held in memory or, with
+ * -tile_rows, kept in scratch files and mapped a tile at a time */
+extern PetscInt tile_rows;    /* raster rows per tile, 0 keeps everything in memory */
+extern PetscInt tile_cache;   /* tiles mapped at once, per array */
+extern char     tile_directory[PATH_MAX];
+
+struct Tile
+{
+   size_t        number;  /* tile held in this slot, -1 if empty */
+   void         *map;     /* page aligned mapping */
+   size_t        length;  /* bytes mapped */
+   char         *data;    /* first element of the tile */
+   unsigned long used;    /* last use, for LRU eviction */
+};
+
+struct TileArray
+{
+   char        *data;      /* the whole array when held in memory */
+   size_t       elsize;    /* bytes per element */
+   size_t       count;     /* number of elements */
+   size_t       tile_len;  /* elements per tile */
+   int          fd;        /* scratch file, -1 when held in memory */
+   struct Tile *slots;
+   int          nslots;
+   int          last;      /* most recently used slot */
+   unsigned long clock;
+   MPI_Win      win;       /* node-shared window holding `data`, or MPI_WIN_NULL */
+};
+
+void  tile_init(struct TileArray *T, size_t elsize, size_t count, size_t tile_len);
+void  tile_free(struct TileArray *T);
+void *tile_fetch(struct TileArray *T, size_t k);
+
+/* Move an array held in memory by rank 0 of `node` into a window shared
+ * by every rank of `node`, where the others can read it in place; they
+ * pass an uninitialised array and get a view of it.  Collective over
+ * `node`.  Returns 0, leaving things as they were, when the array is
+ * mapped from a scratch file.  tile_free() is then collective too. */
+int   tile_share(struct TileArray *T, MPI_Comm node);
+
+/* Address of element `k`.  When tiled, the pointer stays valid until
+ * `tile_cache` other tiles of the same array have been touched, and
+ * only reaches as far as the end of the element's tile.  Tiled arrays
+ * must not be shared between threads. */
+static inline void *tile_at(struct TileArray *T, size_t k)
+{
+   if(T->data)
+      return T->data + k * T->elsize;
+   return tile_fetch(T, k);
+}
+
+static inline int tile_is_mapped(struct TileArray *T)
+{
+   return T->data == NULL;
+}
+
+/* Length of the run starting at `k` that stays within one tile and
+ * ends no later than `end` */
+static inline size_t tile_run(size_t k, size_t end, size_t tile_len)
+{
+   size_t n = tile_len - k % tile_len;
+   return n < end - k ? n : end - k;
+}
+
+#endif  /* TILES_H */
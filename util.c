@@ -64,3 +64,93 @@ double microtime()
    gettimeofday(&tv, NULL);
    return (double)tv.tv_sec + tv.tv_usec / 1e6;
 }
+
+static uint64_t splitmix64(uint64_t *x)
+{
+   uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+   return (x << k) | (x >> (64 - k));
+}
+
+void rng_seed(struct Rng *rng, uint64_t seed)
+{
+   int i;
+   for(i = 0; i < 4; i++)
+      rng->s[i] = splitmix64(&seed);
+}
+
+uint64_t rng_next(struct Rng *rng)
+{
+   uint64_t *s = rng->s;
+   uint64_t result = rotl(s[1] * 5, 7) * 9;
+   uint64_t t = s[1] << 17;
+
+   s[2] ^= s[0];
+   s[3] ^= s[1];
+   s[1] ^= s[2];
+   s[0] ^= s[3];
+   s[2] ^= t;
+   s[3] = rotl(s[3], 45);
+   return result;
+}
+
+/* Uniform integer in [0,n) without modulo bias */
+uint64_t rng_uniform(struct Rng *rng, uint64_t n)
+{
+   uint64_t x, limit = UINT64_MAX - UINT64_MAX % n;
+   do {
+      x = rng_next(rng);
+   } while(x >= limit);
+   return x % n;
+}
+
+/* Uniform double in [0,1) */
+double rng_double(struct Rng *rng)
+{
+   return (rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+void permutation_init(struct Permutation *P, uint64_t n, struct Rng *rng)
+{
+   int i, bits = 1;
+   while(bits < 64 && (1ULL << bits) < n)
+      ++bits;
+   P->n = n;
+   P->half = (bits + 1) / 2;
+   for(i = 0; i < 4; i++)
+      P->keys[i] = rng_next(rng);
+}
+
+static inline uint64_t feistel_round(uint64_t x, uint64_t key)
+{
+   x ^= key;
+   x = (x ^ (x >> 31)) * 0xbf58476d1ce4e5b9ULL;
+   x = (x ^ (x >> 29)) * 0x94d049bb133111ebULL;
+   return x ^ (x >> 32);
+}
+
+/* Cycle walking: a block permutation maps k back into [0,n) after a few
+ * steps on average, since the block is less than 4n wide */
+uint64_t permutation_at(struct Permutation *P, uint64_t k)
+{
+   uint64_t mask = (1ULL << P->half) - 1;
+   uint64_t x = k;
+   int i;
+
+   do {
+      uint64_t l = x >> P->half, r = x & mask;
+      for(i = 0; i < 4; i++) {
+         uint64_t t = r;
+         r = l ^ (feistel_round(r, P->keys[i]) & mask);
+         l = t;
+      }
+      x = (l << P->half) | r;
+   } while(x >= P->n);
+   return x;
+}
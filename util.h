@@ -18,6 +18,8 @@
 #ifndef UTIL_H 
 #define UTIL_H 
 
+#include <stdint.h>
+
 #define streq(X,Y)       (strcasecmp((X),(Y))==0)
 #define startswith(X,P)  (strncmp((X), (P), strlen(P)) == 0)
 #define endswith(X,S)    (strncmp((X + strlen(X) - strlen(S)), (S), strlen(S)) == 0)
@@ -30,4 +32,28 @@ long file_size(const char *path);
 void message(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 double microtime();
 
+/* xoshiro256** generator, seeded through splitmix64 */
+struct Rng
+{
+   uint64_t s[4];
+};
+
+void     rng_seed(struct Rng *rng, uint64_t seed);
+uint64_t rng_next(struct Rng *rng);
+uint64_t rng_uniform(struct Rng *rng, uint64_t n);
+double   rng_double(struct Rng *rng);
+
+/* Pseudo-random permutation of [0,n) that is computed rather than
+ * stored: a Feistel network over the smallest even number of bits that
+ * covers n, applied again until the result falls inside the range */
+struct Permutation
+{
+   uint64_t n;
+   uint64_t keys[4];
+   int      half;     /* bits in each half of a block */
+};
+
+void     permutation_init(struct Permutation *P, uint64_t n, struct Rng *rng);
+uint64_t permutation_at(struct Permutation *P, uint64_t k);
+
 #endif  /* UTIL_H  */